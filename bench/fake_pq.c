@@ -0,0 +1,68 @@
+#include <libpq-fe.h>
+#include <stdlib.h>
+
+// Stand-in for libpq so database.c can be benchmarked without a server
+
+struct pg_conn {
+    int id;
+};
+
+PGconn *PQconnectdbParams(const char *const *keywords, const char *const *values,
+                          int expand_dbname) {
+    (void)keywords;
+    (void)values;
+    (void)expand_dbname;
+
+    static int nextId = 0;
+    PGconn *conn = malloc(sizeof(PGconn));
+    if (conn)
+        conn->id = nextId++;
+    return conn;
+}
+
+ConnStatusType PQstatus(const PGconn *conn) {
+    return conn ? CONNECTION_OK : CONNECTION_BAD;
+}
+
+char *PQerrorMessage(const PGconn *conn) {
+    (void)conn;
+    return "";
+}
+
+void PQfinish(PGconn *conn) {
+    free(conn);
+}
+
+// Only reached with db_shard_map, which the benchmark doesn't set
+PGresult *PQexec(PGconn *conn, const char *query) {
+    (void)conn;
+    (void)query;
+    return NULL;
+}
+
+ExecStatusType PQresultStatus(const PGresult *res) {
+    (void)res;
+    return PGRES_FATAL_ERROR;
+}
+
+char *PQresultErrorField(const PGresult *res, int fieldcode) {
+    (void)res;
+    (void)fieldcode;
+    return NULL;
+}
+
+int PQntuples(const PGresult *res) {
+    (void)res;
+    return 0;
+}
+
+char *PQgetvalue(const PGresult *res, int tup_num, int field_num) {
+    (void)res;
+    (void)tup_num;
+    (void)field_num;
+    return "";
+}
+
+void PQclear(PGresult *res) {
+    (void)res;
+}
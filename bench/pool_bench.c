@@ -0,0 +1,377 @@
+#include <inttypes.h>
+#include <linux/perf_event.h>
+#include <mosquitto_plugin.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "database/database.h"
+#include "pool/pool.h"
+#include "types.h"
+
+#define DEFAULT_OPS 100000
+#define DEFAULT_WORK 100
+#define DEFAULT_WINDOW 1
+#define DEFAULT_CSV "pool_bench.csv"
+
+#define FUTEX_TRACEPOINT "/sys/kernel/tracing/events/syscalls/sys_enter_futex/id"
+#define FUTEX_TRACEPOINT_OLD "/sys/kernel/debug/tracing/events/syscalls/sys_enter_futex/id"
+
+typedef enum {
+    BENCH_THREAD_POOL,
+    BENCH_DB_POOL
+} benchType_t;
+
+typedef struct BenchConfig BenchConfig;
+
+typedef struct {
+    BenchConfig *cfg;
+    int id;
+    _Atomic int inFlight; // Tasks queued by this producer and not yet run
+} Producer;
+
+struct BenchConfig {
+    int producers;
+    int consumers;
+    int ops;    // Per producer
+    int work;   // Spin iterations per task or per held connection
+    int window; // Max tasks in flight per producer
+    uint64_t *latencies;
+    Producer *producerState;
+};
+
+typedef struct {
+    long volCtx;
+    long involCtx;
+    long long futex;
+} SysCounters;
+
+static void spin(int iterations) {
+    for (volatile int i = 0; i < iterations; i++)
+        ;
+}
+
+static int cmp_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+// Counts futex syscalls of this thread and the threads it creates afterwards, -1 if unavailable
+static int open_futex_counter(void) {
+    FILE *f = fopen(FUTEX_TRACEPOINT, "r");
+    if (!f)
+        f = fopen(FUTEX_TRACEPOINT_OLD, "r");
+    if (!f)
+        return -1;
+
+    unsigned long long id;
+    int ok = fscanf(f, "%llu", &id) == 1;
+    fclose(f);
+    if (!ok)
+        return -1;
+
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.type = PERF_TYPE_TRACEPOINT;
+    attr.size = sizeof(attr);
+    attr.config = id;
+    attr.disabled = 1;
+    attr.inherit = 1;
+
+    int fd = (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+    if (fd >= 0)
+        ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+    return fd;
+}
+
+static void counters_start(SysCounters *c) {
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    c->volCtx = ru.ru_nvcsw;
+    c->involCtx = ru.ru_nivcsw;
+}
+
+static void counters_stop(SysCounters *c) {
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    c->volCtx = ru.ru_nvcsw - c->volCtx;
+    c->involCtx = ru.ru_nivcsw - c->involCtx;
+}
+
+// Counts of inherited threads are only folded in when they exit, so read after the pool is freed
+static void counters_read_futex(SysCounters *c, int futexFd) {
+    c->futex = -1;
+
+    if (futexFd >= 0) {
+        uint64_t count;
+        ioctl(futexFd, PERF_EVENT_IOC_DISABLE, 0);
+        if (read(futexFd, &count, sizeof(count)) == sizeof(count))
+            c->futex = (long long)count;
+        close(futexFd);
+    }
+}
+
+// Thread pool: the slot holds the enqueue time and is overwritten with the wait until a worker
+// runs the task, queueing behind other tasks included
+static BenchConfig *benchCfg;
+
+static void bench_task(void *arg) {
+    uint64_t *slot = arg;
+    *slot = now_ns() - *slot;
+    spin(benchCfg->work);
+
+    Producer *p = &benchCfg->producerState[(slot - benchCfg->latencies) / benchCfg->ops];
+    atomic_fetch_sub_explicit(&p->inFlight, 1, memory_order_release);
+}
+
+// Closed loop: a producer waits while it has window tasks queued. With the default window of 1
+// the wait is the wakeup handoff plus at most one task per other producer, larger windows add
+// the time spent behind the queued backlog
+static void *thread_pool_producer(void *arg) {
+    Producer *p = arg;
+    uint64_t *slots = p->cfg->latencies + (size_t)p->id * p->cfg->ops;
+
+    for (int i = 0; i < p->cfg->ops; i++) {
+        while (atomic_load_explicit(&p->inFlight, memory_order_acquire) >= p->cfg->window)
+            sched_yield();
+
+        atomic_fetch_add_explicit(&p->inFlight, 1, memory_order_relaxed);
+        slots[i] = now_ns();
+        while (!add_task(bench_task, &slots[i]))
+            ;
+    }
+    return NULL;
+}
+
+static void wait_tasks_done(BenchConfig *cfg) {
+    for (int i = 0; i < cfg->producers; i++) {
+        while (atomic_load_explicit(&cfg->producerState[i].inFlight, memory_order_acquire) > 0)
+            sched_yield();
+    }
+}
+
+// DB pool: the latency is the time spent waiting in get_conn
+static void *db_pool_producer(void *arg) {
+    Producer *p = arg;
+    uint64_t *slots = p->cfg->latencies + (size_t)p->id * p->cfg->ops;
+
+    for (int i = 0; i < p->cfg->ops; i++) {
+        uint64_t start = now_ns();
+        PGconn *conn = get_conn();
+        slots[i] = now_ns() - start;
+        spin(p->cfg->work);
+        release_conn(conn);
+    }
+    return NULL;
+}
+
+static bool run_producers(BenchConfig *cfg, void *(*fn)(void *)) {
+    pthread_t *threads = malloc(sizeof(pthread_t) * cfg->producers);
+    if (!threads)
+        return false;
+
+    int started = 0;
+    for (; started < cfg->producers; started++) {
+        if (pthread_create(&threads[started], NULL, fn, &cfg->producerState[started]) != 0)
+            break;
+    }
+
+    for (int i = 0; i < started; i++)
+        pthread_join(threads[i], NULL);
+
+    free(threads);
+    return started == cfg->producers;
+}
+
+static bool run_bench(benchType_t type, BenchConfig *cfg, SysCounters *sys, double *seconds) {
+    char consumers[16];
+    snprintf(consumers, sizeof(consumers), "%d", cfg->consumers);
+
+    bool ok;
+    uint64_t start;
+
+    // Opened before the workers exist so it follows them too
+    int futexFd = open_futex_counter();
+
+    // Both pools are timed from after init until every operation completed, so thread creation
+    // and teardown are left out of the numbers
+    if (type == BENCH_THREAD_POOL) {
+        struct mosquitto_opt options[] = {{"num_threads", consumers}};
+
+        benchCfg = cfg;
+        if (!init_thread_pool(options, 1))
+            return false;
+
+        counters_start(sys);
+        start = now_ns();
+        ok = run_producers(cfg, thread_pool_producer);
+        wait_tasks_done(cfg);
+    }
+    else {
+        struct mosquitto_opt options[] = {
+            {"db_host", "fake"}, {"db_user", "fake"}, {"db_pass", "fake"},
+            {"db_name", "fake"}, {"db_port", "0"},    {"max_db_conn", consumers}};
+
+        if (!init_db_vars(options, sizeof(options) / sizeof(options[0])) || !init_db_pool())
+            return false;
+
+        counters_start(sys);
+        start = now_ns();
+        ok = run_producers(cfg, db_pool_producer);
+    }
+
+    *seconds = (double)(now_ns() - start) / NS_PER_SEC;
+    counters_stop(sys);
+
+    if (type == BENCH_THREAD_POOL)
+        free_thread_pool();
+    else
+        free_db_pool();
+
+    counters_read_futex(sys, futexFd);
+
+    return ok;
+}
+
+// Every configuration runs in its own process so the pools start clean and rusage is isolated
+static void run_config(FILE *csv, benchType_t type, int producers, int consumers, int ops,
+                       int work, int window) {
+    fflush(csv);
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        return;
+    }
+
+    if (pid > 0) {
+        int status;
+        waitpid(pid, &status, 0);
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+            fprintf(stderr, "Benchmark %d producers / %d consumers failed\n", producers,
+                    consumers);
+        return;
+    }
+
+    BenchConfig cfg = {producers, consumers, ops, work, window, NULL, NULL};
+    size_t total = (size_t)producers * ops;
+    cfg.latencies = malloc(sizeof(uint64_t) * total);
+    cfg.producerState = calloc(producers, sizeof(Producer));
+    if (!cfg.latencies || !cfg.producerState)
+        _exit(1);
+
+    for (int i = 0; i < producers; i++) {
+        cfg.producerState[i].cfg = &cfg;
+        cfg.producerState[i].id = i;
+    }
+
+    SysCounters sys;
+    double seconds;
+    if (!run_bench(type, &cfg, &sys, &seconds))
+        _exit(1);
+
+    qsort(cfg.latencies, total, sizeof(uint64_t), cmp_u64);
+    uint64_t p99 = cfg.latencies[(total * 99) / 100];
+    double opsPerSec = (double)total / seconds;
+    const char *name = type == BENCH_THREAD_POOL ? "thread_pool" : "db_pool";
+
+    fprintf(csv, "%s,%d,%d,%d,%zu,%.6f,%.0f,%" PRIu64 ",%ld,%ld,%lld\n", name, producers,
+            consumers, window, total, seconds, opsPerSec, p99, sys.volCtx, sys.involCtx,
+            sys.futex);
+    printf("%-11s producers=%-3d consumers=%-3d %12.0f ops/s  p99 wait=%" PRIu64 "ns  "
+           "ctx=%ld/%ld futex=%lld\n",
+           name, producers, consumers, opsPerSec, p99, sys.volCtx, sys.involCtx, sys.futex);
+
+    fflush(csv);
+    fflush(stdout);
+    free(cfg.latencies);
+    free(cfg.producerState);
+    _exit(0);
+}
+
+static int next_step(int n, int max) {
+    if (n < max && n * 2 > max)
+        return max;
+    return n * 2;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "Usage: %s [-t max_threads] [-n ops_per_producer] [-w work] [-q window] [-o file.csv]\n"
+            "  Runs 1..max_threads producers against 1..max_threads workers/connections\n"
+            "  -q limits the thread pool tasks each producer keeps in flight (default %d)\n"
+            "  p99_wait_ns is enqueue to task start for the thread pool, time in get_conn for\n"
+            "  the DB pool\n",
+            prog, DEFAULT_WINDOW);
+}
+
+int main(int argc, char **argv) {
+    int maxThreads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    int ops = DEFAULT_OPS;
+    int work = DEFAULT_WORK;
+    int window = DEFAULT_WINDOW;
+    const char *csvPath = DEFAULT_CSV;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "t:n:w:q:o:h")) != -1) {
+        switch (opt) {
+            case 't':
+                maxThreads = atoi(optarg);
+                break;
+            case 'n':
+                ops = atoi(optarg);
+                break;
+            case 'w':
+                work = atoi(optarg);
+                break;
+            case 'q':
+                window = atoi(optarg);
+                break;
+            case 'o':
+                csvPath = optarg;
+                break;
+            default:
+                usage(argv[0]);
+                return opt == 'h' ? 0 : 1;
+        }
+    }
+
+    if (maxThreads <= 0)
+        maxThreads = 1;
+    if (ops <= 0 || work < 0 || window <= 0) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    FILE *csv = fopen(csvPath, "w");
+    if (!csv) {
+        perror("fopen");
+        return 1;
+    }
+
+    fprintf(csv, "bench,producers,consumers,window,ops,seconds,ops_per_sec,p99_wait_ns,"
+                 "voluntary_ctx_switches,involuntary_ctx_switches,futex_calls\n");
+
+    // Powers of two up to maxThreads, plus maxThreads itself
+    for (int type = BENCH_THREAD_POOL; type <= BENCH_DB_POOL; type++) {
+        for (int p = 1; p <= maxThreads; p = next_step(p, maxThreads)) {
+            for (int c = 1; c <= maxThreads; c = next_step(c, maxThreads))
+                run_config(csv, (benchType_t)type, p, c, ops, work, window);
+        }
+    }
+
+    fclose(csv);
+    printf("Results written to %s\n", csvPath);
+    return 0;
+}
@@ -1,33 +1,160 @@
 #include <libpq-fe.h>
+#include <limits.h>
 #include <mosquitto_plugin.h>
 #include <pthread.h>
+#include <stdatomic.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
+#include "../log/log.h"
+#include "../types.h"
+#include "database.h"
+
+#define DEFAULT_CONN_TIMEOUT_MS 2000
+#define DEFAULT_CONNECT_TIMEOUT "5"
+#define DEFAULT_KEEPALIVES_IDLE "30"
+#define DEFAULT_KEEPALIVES_INTERVAL "10"
+#define DEFAULT_KEEPALIVES_COUNT "3"
+#define DEFAULT_TCP_USER_TIMEOUT "30000"
+#define DEFAULT_STATEMENT_TIMEOUT "30000"
+
+// Consecutive connection failures before a target is skipped
+#define FAILURE_THRESHOLD 3
+#define MIN_BACKOFF_NS (1 * NS_PER_SEC)
+#define MAX_BACKOFF_NS (30 * NS_PER_SEC)
+#define RECONNECT_INTERVAL_NS (1 * NS_PER_SEC)
+#define DEFAULT_SHARD_MAP_REFRESH_SEC 300
+
 typedef struct {
-    PGconn *conn;
+    PGconn *conn; // NULL until the target is reachable
     int busy;
 } ConnWrapper;
 
-ConnWrapper *dbPool;
+typedef struct {
+    char *host;
+    char *port;
+    char *name; // "host:port", used for hashing and the shard map
+    ConnWrapper *pool;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    int failures;
+    uint64_t downUntil;
+    uint64_t backoff;
+    bool probing; // One caller is testing the target after its backoff
+    int inside;   // Workers holding or waiting for a connection of this target
+} DbTarget;
+
+typedef struct {
+    char uuid[UUID_LEN + 1];
+    int target;
+} ShardEntry;
+
+DbTarget *dbTargets;
+int numTargets;
 int maxConn;
+int connTimeoutMs = DEFAULT_CONN_TIMEOUT_MS;
+int maxWorkersPerTarget;
+int numWorkers;
+_Atomic uint64_t lastReconnect;
 
-pthread_mutex_t dbPoolMutex = PTHREAD_MUTEX_INITIALIZER;
-pthread_cond_t dbPoolCond = PTHREAD_COND_INITIALIZER;
+// Swapped by the refresh task, routing holds the read lock only for the lookup
+ShardEntry *shardMap;
+int shardMapLen;
+pthread_rwlock_t shardLock = PTHREAD_RWLOCK_INITIALIZER;
+uint64_t shardMapRefresh;
+_Atomic uint64_t lastShardRefresh;
 
 const char *DB_HOST;
+const char *DB_HOSTS;
 const char *DB_USER;
 const char *DB_PASS;
 const char *DB_NAME;
 const char *DB_PORT;
+const char *DB_CONNECT_TIMEOUT;
+const char *DB_KEEPALIVES_IDLE;
+const char *DB_KEEPALIVES_INTERVAL;
+const char *DB_KEEPALIVES_COUNT;
+const char *DB_TCP_USER_TIMEOUT;
+const char *DB_STATEMENT_TIMEOUT;
+char DB_OPTIONS[64];
+bool DB_SHARD_MAP;
+
+static bool add_target(const char *host, size_t hostLen, const char *port) {
+    DbTarget *targets = realloc(dbTargets, sizeof(DbTarget) * (numTargets + 1));
+    if (!targets) {
+        perror("realloc");
+        return false;
+    }
+    dbTargets = targets;
+
+    DbTarget *t = &dbTargets[numTargets];
+    memset(t, 0, sizeof(DbTarget));
+    t->host = strndup(host, hostLen);
+    t->port = strdup(port);
+    size_t nameLen = hostLen + strlen(port) + 2;
+    t->name = malloc(nameLen);
+    if (!t->host || !t->port || !t->name) {
+        free(t->host);
+        free(t->port);
+        free(t->name);
+        return false;
+    }
+    snprintf(t->name, nameLen, "%s:%s", t->host, t->port);
+
+    numTargets++;
+    return true;
+}
+
+// Accepts "host1:5432,host2,host3:5433", entries without port use db_port
+static bool parse_targets(void) {
+    if (!DB_HOSTS)
+        return add_target(DB_HOST, strlen(DB_HOST), DB_PORT);
+
+    const char *p = DB_HOSTS;
+    while (*p) {
+        size_t len = strcspn(p, ",");
+        const char *colon = memchr(p, ':', len);
+
+        bool ok;
+        if (colon) {
+            char port[16];
+            size_t portLen = len - (size_t)(colon - p) - 1;
+            if (portLen == 0 || portLen >= sizeof(port))
+                ok = false;
+            else {
+                memcpy(port, colon + 1, portLen);
+                port[portLen] = '\0';
+                ok = colon > p && add_target(p, (size_t)(colon - p), port);
+            }
+        }
+        else {
+            ok = len > 0 && add_target(p, len, DB_PORT);
+        }
+
+        if (!ok) {
+            fprintf(stderr, "[WEATHER_COLLECTOR] Invalid db_hosts entry: %.*s\n", (int)len, p);
+            return false;
+        }
+
+        p += len;
+        if (*p == ',')
+            p++;
+    }
+
+    return numTargets > 0;
+}
 
 bool init_db_vars(struct mosquitto_opt *options, int optionsCount) {
     for (int i = 0; i < optionsCount; i++) {
         if (strcmp(options[i].key, "db_host") == 0)
             DB_HOST = options[i].value;
+        else if (strcmp(options[i].key, "db_hosts") == 0)
+            DB_HOSTS = options[i].value;
         else if (strcmp(options[i].key, "db_user") == 0)
             DB_USER = options[i].value;
         else if (strcmp(options[i].key, "db_pass") == 0)
@@ -38,12 +165,34 @@ bool init_db_vars(struct mosquitto_opt *options, int optionsCount) {
             DB_PORT = options[i].value;
         else if (strcmp(options[i].key, "max_db_conn") == 0)
             maxConn = atoi(options[i].value);
+        else if (strcmp(options[i].key, "db_conn_timeout_ms") == 0)
+            connTimeoutMs = atoi(options[i].value);
+        else if (strcmp(options[i].key, "db_target_max_workers") == 0)
+            maxWorkersPerTarget = atoi(options[i].value);
+        else if (strcmp(options[i].key, "num_threads") == 0)
+            numWorkers = atoi(options[i].value);
+        else if (strcmp(options[i].key, "db_connect_timeout") == 0)
+            DB_CONNECT_TIMEOUT = options[i].value;
+        else if (strcmp(options[i].key, "db_keepalives_idle") == 0)
+            DB_KEEPALIVES_IDLE = options[i].value;
+        else if (strcmp(options[i].key, "db_keepalives_interval") == 0)
+            DB_KEEPALIVES_INTERVAL = options[i].value;
+        else if (strcmp(options[i].key, "db_keepalives_count") == 0)
+            DB_KEEPALIVES_COUNT = options[i].value;
+        else if (strcmp(options[i].key, "db_tcp_user_timeout_ms") == 0)
+            DB_TCP_USER_TIMEOUT = options[i].value;
+        else if (strcmp(options[i].key, "db_statement_timeout_ms") == 0)
+            DB_STATEMENT_TIMEOUT = options[i].value;
+        else if (strcmp(options[i].key, "db_shard_map") == 0)
+            DB_SHARD_MAP = strcmp(options[i].value, "true") == 0;
+        else if (strcmp(options[i].key, "db_shard_map_refresh") == 0)
+            shardMapRefresh = (uint64_t)atoi(options[i].value) * NS_PER_SEC;
     }
 
-    if (!DB_HOST || !DB_USER || !DB_PASS || !DB_NAME || DB_PORT == 0) {
+    if ((!DB_HOST && !DB_HOSTS) || !DB_USER || !DB_PASS || !DB_NAME || DB_PORT == 0) {
         fprintf(stderr, "[WEATHER_COLLECTOR] Missing obligatory config:\n");
-        if (!DB_HOST)
-            fprintf(stderr, "db_host\n");
+        if (!DB_HOST && !DB_HOSTS)
+            fprintf(stderr, "db_host or db_hosts\n");
         if (!DB_USER)
             fprintf(stderr, "db_user\n");
         if (!DB_PASS)
@@ -61,19 +210,77 @@ bool init_db_vars(struct mosquitto_opt *options, int optionsCount) {
             maxConn = 1;
     }
 
+    if (numWorkers <= 0) {
+        numWorkers = (int)sysconf(_SC_NPROCESSORS_ONLN);
+        if (numWorkers <= 0)
+            numWorkers = 1;
+    }
+
+    if (!DB_CONNECT_TIMEOUT)
+        DB_CONNECT_TIMEOUT = DEFAULT_CONNECT_TIMEOUT;
+    if (!DB_KEEPALIVES_IDLE)
+        DB_KEEPALIVES_IDLE = DEFAULT_KEEPALIVES_IDLE;
+    if (!DB_KEEPALIVES_INTERVAL)
+        DB_KEEPALIVES_INTERVAL = DEFAULT_KEEPALIVES_INTERVAL;
+    if (!DB_KEEPALIVES_COUNT)
+        DB_KEEPALIVES_COUNT = DEFAULT_KEEPALIVES_COUNT;
+    if (!DB_TCP_USER_TIMEOUT)
+        DB_TCP_USER_TIMEOUT = DEFAULT_TCP_USER_TIMEOUT;
+    if (!DB_STATEMENT_TIMEOUT)
+        DB_STATEMENT_TIMEOUT = DEFAULT_STATEMENT_TIMEOUT;
+
+    snprintf(DB_OPTIONS, sizeof(DB_OPTIONS), "-c statement_timeout=%s", DB_STATEMENT_TIMEOUT);
+
+    if (shardMapRefresh == 0)
+        shardMapRefresh = DEFAULT_SHARD_MAP_REFRESH_SEC * NS_PER_SEC;
+
+    if (!parse_targets())
+        return false;
+
+    // All shards share the thread pool, by default a stalled one can hold at most half of it.
+    // With a single target there is nobody to protect
+    if (maxWorkersPerTarget <= 0)
+        maxWorkersPerTarget = numTargets > 1 ? (numWorkers + 1) / 2 : INT_MAX;
+
     return true;
 }
 
-PGconn *init_db_conn(void) {
+// Keepalives and tcp_user_timeout detect a dead peer on an idle or stuck socket, the statement
+// timeout bounds a query on a server that is up but not answering
+PGconn *init_db_conn(const DbTarget *target) {
+    const char *keywords[] = {"host",
+                              "port",
+                              "dbname",
+                              "user",
+                              "password",
+                              "connect_timeout",
+                              "keepalives",
+                              "keepalives_idle",
+                              "keepalives_interval",
+                              "keepalives_count",
+                              "tcp_user_timeout",
+                              "options",
+                              NULL};
+    const char *values[] = {target->host,
+                            target->port,
+                            DB_NAME,
+                            DB_USER,
+                            DB_PASS,
+                            DB_CONNECT_TIMEOUT,
+                            "1",
+                            DB_KEEPALIVES_IDLE,
+                            DB_KEEPALIVES_INTERVAL,
+                            DB_KEEPALIVES_COUNT,
+                            DB_TCP_USER_TIMEOUT,
+                            DB_OPTIONS,
+                            NULL};
 
-    PGconn *conn;
-    conn = PQsetdbLogin(DB_HOST, DB_PORT,
-                        NULL, // options
-                        NULL, // tty
-                        DB_NAME, DB_USER, DB_PASS);
+    PGconn *conn = PQconnectdbParams(keywords, values, 0);
 
     if (PQstatus(conn) != CONNECTION_OK) {
-        fprintf(stderr, "Connection error: %s\n", PQerrorMessage(conn));
+        char detail[256];
+        snprintf(detail, sizeof(detail), "%s: %s", target->name, PQerrorMessage(conn));
+        log_event(LOG_SUB_DB, LOG_LVL_ERR, "Connection error", detail);
         PQfinish(conn);
         return NULL;
     }
@@ -81,72 +288,456 @@ PGconn *init_db_conn(void) {
     return conn;
 }
 
-bool init_db_pool(void) {
-    // Reserve memory for the dbPool
-    dbPool = malloc(sizeof(ConnWrapper) * maxConn);
-    if (!dbPool) {
-        perror("malloc");
+// Called with the target mutex held
+static void mark_result(DbTarget *t, bool ok) {
+    t->probing = false;
+
+    if (ok) {
+        if (t->failures >= FAILURE_THRESHOLD)
+            log_event(LOG_SUB_DB, LOG_LVL_NOTICE, "Database is back", t->name);
+        t->failures = 0;
+        t->downUntil = 0;
+        t->backoff = MIN_BACKOFF_NS;
+        return;
+    }
+
+    t->failures++;
+    if (t->failures >= FAILURE_THRESHOLD) {
+        if (t->failures == FAILURE_THRESHOLD)
+            log_event(LOG_SUB_DB, LOG_LVL_ERR, "Database marked down", t->name);
+        t->downUntil = now_ns() + t->backoff;
+        t->backoff = t->backoff * 2 > MAX_BACKOFF_NS ? MAX_BACKOFF_NS : t->backoff * 2;
+    }
+}
+
+static int cmp_shard(const void *a, const void *b) {
+    return strcmp(((const ShardEntry *)a)->uuid, ((const ShardEntry *)b)->uuid);
+}
+
+static int find_target(const char *name) {
+    for (int i = 0; i < numTargets; i++) {
+        if (strcmp(dbTargets[i].name, name) == 0)
+            return i;
+    }
+    return -1;
+}
+
+static bool load_shard_map(void);
+
+static bool init_target(DbTarget *t) {
+    pthread_condattr_t attr;
+
+    t->pool = calloc(maxConn, sizeof(ConnWrapper));
+    if (!t->pool) {
+        perror("calloc");
         return false;
     }
 
+    t->failures = 0;
+    t->downUntil = 0;
+    t->backoff = MIN_BACKOFF_NS;
+    t->probing = false;
+    t->inside = 0;
+
+    if (pthread_mutex_init(&t->mutex, NULL) != 0)
+        return false;
+    if (pthread_condattr_init(&attr) != 0)
+        return false;
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    int err = pthread_cond_init(&t->cond, &attr);
+    pthread_condattr_destroy(&attr);
+    if (err != 0)
+        return false;
+
+    // A target that is down at startup is retried lazily by the workers
     for (int i = 0; i < maxConn; i++) {
-        dbPool[i].conn = init_db_conn();
-        dbPool[i].busy = 0;
-        if (!dbPool[i].conn) {
-            // Clean all initialized connections
-            for (int j = 0; j < i; j++)
-                PQfinish(dbPool[j].conn);
-            free(dbPool);
-            dbPool = NULL;
-            return false;
+        t->pool[i].conn = init_db_conn(t);
+        if (!t->pool[i].conn) {
+            t->failures = FAILURE_THRESHOLD - 1;
+            mark_result(t, false);
+            break;
         }
     }
+
     return true;
 }
 
+static void free_target(DbTarget *t) {
+    if (t->pool) {
+        for (int i = 0; i < maxConn; i++) {
+            if (t->pool[i].conn)
+                PQfinish(t->pool[i].conn);
+        }
+        free(t->pool);
+        t->pool = NULL;
+        pthread_mutex_destroy(&t->mutex);
+        pthread_cond_destroy(&t->cond);
+    }
+
+    free(t->host);
+    free(t->port);
+    free(t->name);
+}
+
 void free_db_pool(void) {
-    if (!dbPool)
+    if (!dbTargets)
         return;
 
-    for (int i = 0; i < maxConn; i++) {
-        PQfinish(dbPool[i].conn);
+    for (int i = 0; i < numTargets; i++)
+        free_target(&dbTargets[i]);
+
+    free(dbTargets);
+    dbTargets = NULL;
+    numTargets = 0;
+
+    pthread_rwlock_wrlock(&shardLock);
+    free(shardMap);
+    shardMap = NULL;
+    shardMapLen = 0;
+    pthread_rwlock_unlock(&shardLock);
+}
+
+bool init_db_pool(void) {
+    int up = 0;
+
+    for (int i = 0; i < numTargets; i++) {
+        if (!init_target(&dbTargets[i])) {
+            free_db_pool();
+            return false;
+        }
+        if (dbTargets[i].failures == 0)
+            up++;
     }
 
-    free(dbPool);
-    dbPool = NULL;
+    // Ingest can start with some nodes down, but not with all of them
+    if (up == 0) {
+        free_db_pool();
+        return false;
+    }
+
+    if (DB_SHARD_MAP) {
+        if (!load_shard_map()) {
+            free_db_pool();
+            return false;
+        }
+        atomic_store(&lastShardRefresh, now_ns());
+    }
 
-    pthread_mutex_destroy(&dbPoolMutex);
-    pthread_cond_destroy(&dbPoolCond);
+    return true;
 }
 
-PGconn *get_conn(void) {
-    PGconn *ret = NULL;
+static uint64_t hash_combine(const char *a, const char *b) {
+    // FNV-1a over both strings
+    uint64_t hash = 14695981039346656037ULL;
+    for (const char *p = a; *p; p++) {
+        hash ^= (unsigned char)*p;
+        hash *= 1099511628211ULL;
+    }
+    hash ^= 0xff;
+    hash *= 1099511628211ULL;
+    for (const char *p = b; *p; p++) {
+        hash ^= (unsigned char)*p;
+        hash *= 1099511628211ULL;
+    }
+    // Final mix so similar names don't produce correlated scores
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 33;
+    return hash;
+}
 
-    pthread_mutex_lock(&dbPoolMutex);
+// Rendezvous hashing: adding a node only moves the stations that now score highest on it
+static int route_station(const char *stationUUID) {
+    if (numTargets == 1 || !stationUUID)
+        return 0;
+
+    if (DB_SHARD_MAP) {
+        ShardEntry key;
+        snprintf(key.uuid, sizeof(key.uuid), "%s", stationUUID);
+
+        pthread_rwlock_rdlock(&shardLock);
+        ShardEntry *entry =
+            shardMapLen > 0
+                ? bsearch(&key, shardMap, shardMapLen, sizeof(ShardEntry), cmp_shard)
+                : NULL;
+        int target = entry ? entry->target : -1;
+        pthread_rwlock_unlock(&shardLock);
+
+        if (target >= 0)
+            return target;
+
+        log_event(LOG_SUB_DB, LOG_LVL_WARNING, "Station not in the shard map, routed by hash",
+                  stationUUID);
+    }
+
+    int best = 0;
+    uint64_t bestScore = 0;
+    for (int i = 0; i < numTargets; i++) {
+        uint64_t score = hash_combine(stationUUID, dbTargets[i].name);
+        if (score > bestScore) {
+            bestScore = score;
+            best = i;
+        }
+    }
+    return best;
+}
+
+static int find_free_slot(const DbTarget *t, bool allowConnect) {
+    int empty = -1;
+
+    // Prefer a live connection over opening a new one
+    for (int i = 0; i < maxConn; i++) {
+        if (t->pool[i].busy)
+            continue;
+        if (t->pool[i].conn)
+            return i;
+        if (empty < 0)
+            empty = i;
+    }
+
+    return allowConnect ? empty : -1;
+}
+
+// Returns NULL if the target is down, already has maxWorkersPerTarget callers or no connection
+// frees up within timeoutMs (< 0 waits forever). Without allowConnect only live connections are
+// handed out, so the caller never blocks on a TCP handshake
+static PGconn *get_target_conn(DbTarget *t, int timeoutMs, bool allowConnect) {
+    struct timespec deadline;
+    if (timeoutMs >= 0) {
+        uint64_t ns = now_ns() + (uint64_t)timeoutMs * NS_PER_MS;
+        deadline.tv_sec = (time_t)(ns / NS_PER_SEC);
+        deadline.tv_nsec = (long)(ns % NS_PER_SEC);
+    }
+
+    pthread_mutex_lock(&t->mutex);
+
+    // Fail fast so a broken node doesn't hold workers the other nodes need. Once the backoff
+    // expires a single caller probes it and the rest keep failing until it reports back
+    bool probe = false;
+    if (t->downUntil != 0) {
+        if (now_ns() < t->downUntil || t->probing) {
+            pthread_mutex_unlock(&t->mutex);
+            return NULL;
+        }
+        t->probing = probe = true;
+    }
+
+    // Keeps a slow target from taking every worker away from the healthy ones
+    if (t->inside >= maxWorkersPerTarget) {
+        if (probe)
+            t->probing = false;
+        pthread_mutex_unlock(&t->mutex);
+        return NULL;
+    }
+    t->inside++;
 
     // Wait for a free connection
     while (1) {
-        for (int i = 0; i < maxConn; i++) {
-            if (dbPool[i].busy == 0) {
-                dbPool[i].busy = 1; // Mark connection as busy
-                ret = dbPool[i].conn;
-                pthread_mutex_unlock(&dbPoolMutex);
+        int i = find_free_slot(t, allowConnect);
+        if (i >= 0) {
+            t->pool[i].busy = 1; // Mark connection as busy
+            PGconn *ret = t->pool[i].conn;
+            pthread_mutex_unlock(&t->mutex);
+
+            // The probe result is reported by release_conn
+            if (ret)
                 return ret;
+
+            // Connect outside the lock, the slot is ours
+            ret = init_db_conn(t);
+
+            pthread_mutex_lock(&t->mutex);
+            t->pool[i].conn = ret;
+            if (!ret) {
+                t->pool[i].busy = 0;
+                t->inside--;
+                mark_result(t, false);
+                pthread_cond_signal(&t->cond);
             }
+            pthread_mutex_unlock(&t->mutex);
+            return ret;
         }
+
+        // Only empty slots left, a worker has to reconnect them
+        if (!allowConnect && find_free_slot(t, true) >= 0)
+            break;
+
         // There aren't any free connection, wait for release_conn to make a signal
-        pthread_cond_wait(&dbPoolCond, &dbPoolMutex);
+        if (timeoutMs < 0)
+            pthread_cond_wait(&t->cond, &t->mutex);
+        else if (pthread_cond_timedwait(&t->cond, &t->mutex, &deadline) != 0)
+            break;
+    }
+
+    t->inside--;
+    if (probe)
+        t->probing = false;
+    pthread_mutex_unlock(&t->mutex);
+    return NULL;
+}
+
+PGconn *get_conn(void) {
+    return get_target_conn(&dbTargets[0], -1, true);
+}
+
+PGconn *get_conn_for_station(const char *stationUUID, int timeoutMs, bool allowConnect) {
+    if (timeoutMs == DB_CONN_TIMEOUT_DEFAULT)
+        timeoutMs = connTimeoutMs;
+    return get_target_conn(&dbTargets[route_station(stationUUID)], timeoutMs, allowConnect);
+}
+
+bool db_reconnect_wanted(void) {
+    uint64_t now = now_ns();
+    uint64_t last = atomic_load_explicit(&lastReconnect, memory_order_relaxed);
+
+    // At most one reconnect task per interval, however many callers fail
+    return now - last >= RECONNECT_INTERVAL_NS &&
+           atomic_compare_exchange_strong_explicit(&lastReconnect, &last, now,
+                                                   memory_order_relaxed, memory_order_relaxed);
+}
+
+// Errors that say something about the server rather than the statement: connection problems,
+// resource exhaustion and cancellations such as statement_timeout
+static bool server_error(const PGresult *res) {
+    if (PQresultStatus(res) != PGRES_FATAL_ERROR)
+        return false;
+
+    const char *state = PQresultErrorField(res, PG_DIAG_SQLSTATE);
+    if (!state)
+        return true; // Raised by libpq itself
+
+    return strncmp(state, "08", 2) == 0 || strncmp(state, "53", 2) == 0 ||
+           strncmp(state, "57", 2) == 0 || strncmp(state, "58", 2) == 0;
+}
+
+static void release(PGconn *conn, bool queryOk) {
+    if (!conn)
+        return;
+
+    // A broken connection is dropped instead of reset, release can run on the broker thread and
+    // the next worker that takes the slot reconnects it
+    bool alive = PQstatus(conn) == CONNECTION_OK;
+    bool ok = alive && queryOk;
+
+    for (int t = 0; t < numTargets; t++) {
+        DbTarget *target = &dbTargets[t];
+
+        pthread_mutex_lock(&target->mutex);
+        for (int i = 0; i < maxConn; i++) {
+            if (target->pool[i].conn == conn) {
+                if (!alive)
+                    target->pool[i].conn = NULL;
+                target->pool[i].busy = 0;           // Mark connection as free
+                target->inside--;
+                mark_result(target, ok);
+                pthread_cond_signal(&target->cond); // Awake a waiting thread
+                pthread_mutex_unlock(&target->mutex);
+
+                if (!alive)
+                    PQfinish(conn);
+                return;
+            }
+        }
+        pthread_mutex_unlock(&target->mutex);
     }
 }
 
 void release_conn(PGconn *conn) {
-    pthread_mutex_lock(&dbPoolMutex);
-    for (int i = 0; i < maxConn; i++) {
-        if (dbPool[i].conn == conn) {
-            dbPool[i].busy = 0;               // Mark connection as free
-            pthread_cond_signal(&dbPoolCond); // Awake a waiting thread
-            break;
+    release(conn, true);
+}
+
+void release_conn_result(PGconn *conn, const PGresult *res) {
+    release(conn, !server_error(res));
+}
+
+void db_reconnect_task(void *arg) {
+    (void)arg;
+
+    for (int i = 0; i < numTargets; i++) {
+        PGconn *conn = get_target_conn(&dbTargets[i], 0, true);
+        if (conn)
+            release_conn(conn);
+    }
+}
+
+// stations.shard_map (station_id, db_target "host:port") is replicated on every node. A node that
+// can't answer is skipped, the first one that can provides the map
+static bool load_shard_map(void) {
+    for (int i = 0; i < numTargets; i++) {
+        PGconn *conn = get_target_conn(&dbTargets[i], connTimeoutMs, true);
+        if (!conn)
+            continue;
+
+        PGresult *res = PQexec(conn, "SELECT s.uuid, m.db_target "
+                                     "FROM stations.shard_map m "
+                                     "JOIN stations.stations s ON s.station_id = m.station_id");
+
+        if (PQresultStatus(res) != PGRES_TUPLES_OK) {
+            char detail[256];
+            snprintf(detail, sizeof(detail), "%s: %s", dbTargets[i].name, PQerrorMessage(conn));
+            log_event(LOG_SUB_DB, LOG_LVL_ERR, "Error loading the shard map", detail);
+            release_conn_result(conn, res);
+            PQclear(res);
+            continue;
         }
+        release_conn(conn);
+
+        int rows = PQntuples(res);
+        ShardEntry *entries = malloc(sizeof(ShardEntry) * (rows > 0 ? rows : 1));
+        if (!entries) {
+            PQclear(res);
+            return false;
+        }
+
+        int len = 0;
+        for (int r = 0; r < rows; r++) {
+            int target = find_target(PQgetvalue(res, r, 1));
+            if (target < 0) {
+                char detail[128];
+                snprintf(detail, sizeof(detail), "%s for %s", PQgetvalue(res, r, 1),
+                         PQgetvalue(res, r, 0));
+                log_event(LOG_SUB_DB, LOG_LVL_WARNING, "Unknown shard target", detail);
+                continue;
+            }
+            snprintf(entries[len].uuid, sizeof(entries[len].uuid), "%s", PQgetvalue(res, r, 0));
+            entries[len].target = target;
+            len++;
+        }
+
+        PQclear(res);
+        qsort(entries, len, sizeof(ShardEntry), cmp_shard);
+
+        pthread_rwlock_wrlock(&shardLock);
+        ShardEntry *old = shardMap;
+        shardMap = entries;
+        shardMapLen = len;
+        pthread_rwlock_unlock(&shardLock);
+        free(old);
+
+        char detail[128];
+        snprintf(detail, sizeof(detail), "%d stations from %s", len, dbTargets[i].name);
+        log_event(LOG_SUB_DB, LOG_LVL_INFO, "Shard map loaded", detail);
+        return true;
     }
-    pthread_mutex_unlock(&dbPoolMutex);
+
+    log_event(LOG_SUB_DB, LOG_LVL_ERR, "No database could provide the shard map", NULL);
+    return false;
+}
+
+bool db_shard_map_refresh_due(void) {
+    if (!DB_SHARD_MAP || !dbTargets)
+        return false;
+
+    uint64_t now = now_ns();
+    uint64_t last = atomic_load_explicit(&lastShardRefresh, memory_order_relaxed);
+
+    return now - last >= shardMapRefresh &&
+           atomic_compare_exchange_strong_explicit(&lastShardRefresh, &last, now,
+                                                   memory_order_relaxed, memory_order_relaxed);
+}
+
+// The previous map stays in use when no node can provide a new one
+void db_shard_map_refresh_task(void *arg) {
+    (void)arg;
+    load_shard_map();
 }
@@ -11,8 +11,30 @@ bool init_db_vars(struct mosquitto_opt *options, int option_count);
 bool init_db_pool(void);
 void free_db_pool(void);
 
+// Blocks until a connection to the first target is free
 PGconn *get_conn(void);
 
+// Uses db_conn_timeout_ms
+#define DB_CONN_TIMEOUT_DEFAULT -2
+
+// Routes by shard map or consistent hash, NULL if the target is down, saturated or no connection
+// frees up within timeoutMs (DB_CONN_TIMEOUT_DEFAULT, -1 waits forever). Without allowConnect
+// empty slots are not reconnected, for callers running on the broker thread
+PGconn *get_conn_for_station(const char *stationUUID, int timeoutMs, bool allowConnect);
+
+// True at most once per second, the caller then queues db_reconnect_task on a worker
+bool db_reconnect_wanted(void);
+void db_reconnect_task(void *arg);
+
+// True once every db_shard_map_refresh seconds with db_shard_map, the caller then queues
+// db_shard_map_refresh_task on a worker
+bool db_shard_map_refresh_due(void);
+void db_shard_map_refresh_task(void *arg);
+
 void release_conn(PGconn *conn);
 
+// Also counts res against the target health when it failed because of the server (timeouts,
+// lost connection, resource errors), so an overloaded node ends up marked down
+void release_conn_result(PGconn *conn, const PGresult *res);
+
 #endif
@@ -1,9 +1,13 @@
 #include <inttypes.h>
 #include <libpq-fe.h>
+#include <stdatomic.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 
 #include "../database/database.h"
+#include "../log/log.h"
+#include "../trace/trace.h"
 #include "../types.h"
 
 #include "pb.h"
@@ -15,6 +19,8 @@
 #define FLOAT_STR_SIZE 32
 #define UINT64_STR_SIZE 21
 
+static _Atomic uint64_t droppedMessages;
+
 typedef enum {
     TEMP,
     HUMIDITY,
@@ -72,13 +78,19 @@ void handle_insert_data(void *arg) {
     PGresult *res = NULL;
     PGconn *conn = NULL;
 
+    uint64_t stageStart = trace_clock(task->traceId);
+    if (task->traceId)
+        trace_record(task->traceId, TRACE_QUEUE, task->enqueuedAt, stageStart);
+
     pb_istream_t stream = pb_istream_from_buffer(task->payload, task->payloadLen);
 
     if (!pb_decode(&stream, weather_WeatherMeasurement_fields, &meas)) {
-        fprintf(stderr, "Nanopb decode error: %s\n", PB_GET_ERROR(&stream));
+        log_event(LOG_SUB_INGEST, LOG_LVL_ERR, "Nanopb decode error", PB_GET_ERROR(&stream));
         goto cleanup;
     }
 
+    trace_span(task->traceId, TRACE_DECODE, stageStart);
+
     if (meas.periodStart == 0 || meas.periodEnd == 0)
         goto cleanup;
 
@@ -99,8 +111,16 @@ void handle_insert_data(void *arg) {
         ptrs[WIND_SPEED], ptrs[WIND_DIRECTION],  ptrs[GUST_SPEED], ptrs[GUST_DIRECTION],
         ptrs[RAINFALL],   ptrs[SOLAR_IRRADIANCE]};
 
-    conn = get_conn();
+    stageStart = trace_clock(task->traceId);
+    conn = get_conn_for_station(task->username, DB_CONN_TIMEOUT_DEFAULT, true);
+    trace_span(task->traceId, TRACE_GET_CONN, stageStart);
+    if (!conn) {
+        atomic_fetch_add_explicit(&droppedMessages, 1, memory_order_relaxed);
+        log_event(LOG_SUB_DB, LOG_LVL_ERR, "No database available for station", task->username);
+        goto cleanup;
+    }
 
+    stageStart = trace_clock(task->traceId);
     res = PQexecParams(conn,
                        "INSERT INTO weather.weather_data (station_id, time_range, temperature, "
                        "humidity, pressure, lux, uvi, wind_speed, wind_direction, gust_speed, "
@@ -112,14 +132,17 @@ void handle_insert_data(void *arg) {
                        "  $4, $5, $6, $7, $8, $9, $10, $11, $12, $13, $14"
                        ")",
                        14, NULL, paramValues, NULL, NULL, 0);
+    trace_span(task->traceId, TRACE_POSTGRES, stageStart);
 
     if (PQresultStatus(res) != PGRES_COMMAND_OK) {
-        fprintf(stderr, "Postgres error: %s\n", PQerrorMessage(conn));
+        char detail[256];
+        snprintf(detail, sizeof(detail), "%s: %s", task->username, PQerrorMessage(conn));
+        log_event(LOG_SUB_DB, LOG_LVL_ERR, "Postgres error", detail);
     }
 
 cleanup:
     if (conn)
-        release_conn(conn);
+        release_conn_result(conn, res);
     if (res)
         PQclear(res);
     if (buffer)
@@ -132,3 +155,7 @@ cleanup:
         free(task);
     }
 }
+
+uint64_t handler_dropped_messages(void) {
+    return atomic_load_explicit(&droppedMessages, memory_order_relaxed);
+}
@@ -1,8 +1,13 @@
 #ifndef HANDLERS_H
 #define HANDLERS_H
 
+#include <stdint.h>
+
 struct msgTask;
 
 void handle_insert_data(void *arg);
 
+// Messages discarded because their database was down or saturated
+uint64_t handler_dropped_messages(void);
+
 #endif
@@ -0,0 +1,463 @@
+#include <inttypes.h>
+#include <mosquitto_plugin.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../types.h"
+#include "log.h"
+
+#define DETAIL_LEN 160
+#define LINE_LEN 320
+
+#define DEFAULT_RING_SIZE 4096
+#define DEFAULT_WINDOW_SEC 10
+#define DEFAULT_BURST 5
+#define POLL_MS 50
+
+// Aggregation keys are (subsystem, msg) pairs, only a handful of call sites exist
+#define AGG_SLOTS 256
+
+typedef struct {
+    uint64_t time; // CLOCK_REALTIME ns
+    const char *msg;
+    unsigned char level;
+    unsigned char sub;
+    char detail[DETAIL_LEN];
+} LogRecord;
+
+// Bounded MPMC ring (Vyukov), producers never block and drop when full
+typedef struct {
+    _Atomic size_t seq;
+    LogRecord rec;
+} LogSlot;
+
+// Formatted line waiting for log_flush, the logger thread is the only producer
+typedef struct {
+    unsigned char level;
+    char line[LINE_LEN];
+} SinkLine;
+
+typedef struct {
+    const char *msg; // NULL if the slot is free
+    unsigned char sub;
+    unsigned char level;
+    uint64_t windowStart; // CLOCK_MONOTONIC ns
+    unsigned written;
+    unsigned suppressed;
+} AggEntry;
+
+typedef struct {
+    LogSlot *slots;
+    size_t size; // Power of two
+    _Atomic size_t enqueuePos;
+    size_t dequeuePos; // Only touched by the logger thread
+    _Atomic uint64_t dropped;
+    _Atomic bool running;
+    _Atomic bool shutdown;
+    pthread_t thread;
+    logSink_t sink;
+    SinkLine *sinkLines; // Single producer single consumer ring, same size as slots
+    _Atomic size_t sinkHead;
+    _Atomic size_t sinkTail;
+    _Atomic uint64_t sinkDropped;
+    FILE *file;
+    uint64_t window;
+    unsigned burst;
+    AggEntry agg[AGG_SLOTS];
+} Logger;
+
+static const char *levelNames[] = {"debug", "info", "notice", "warning", "err", "none"};
+static const char *subNames[LOG_SUB_COUNT] = {"auth", "acl", "ingest", "db", "ratelimit",
+                                              "trace"};
+
+unsigned char logLevels[LOG_SUB_COUNT] = {LOG_LVL_INFO, LOG_LVL_INFO, LOG_LVL_INFO,
+                                          LOG_LVL_INFO, LOG_LVL_INFO, LOG_LVL_INFO};
+
+// Global logger
+Logger logger;
+
+// Wall clock for the line timestamps, aggregation windows use now_ns()
+static uint64_t realtime_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * NS_PER_SEC + (uint64_t)ts.tv_nsec;
+}
+
+static bool parse_level(const char *str, unsigned char *level) {
+    for (int i = LOG_LVL_DEBUG; i <= LOG_LVL_NONE; i++) {
+        if (strcmp(str, levelNames[i]) == 0) {
+            *level = (unsigned char)i;
+            return true;
+        }
+    }
+    return false;
+}
+
+static void format_line(const LogRecord *rec, const char *suffix, char *line, size_t len) {
+    const char *detail = rec->detail;
+    int detailLen = (int)strcspn(detail, "\n");
+
+    if (detailLen > 0)
+        snprintf(line, len, "[WEATHER_COLLECTOR] [%s] %s: %.*s%s", subNames[rec->sub], rec->msg,
+                 detailLen, detail, suffix);
+    else
+        snprintf(line, len, "[WEATHER_COLLECTOR] [%s] %s%s", subNames[rec->sub], rec->msg,
+                 suffix);
+}
+
+// The sink may not be thread safe (mosquitto_log_printf isn't), so its lines are queued for the
+// broker thread instead of being written from here
+static void queue_sink_line(logLevel_t level, const char *line) {
+    size_t head = atomic_load_explicit(&logger.sinkHead, memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&logger.sinkTail, memory_order_acquire);
+
+    if (head - tail >= logger.size) {
+        atomic_fetch_add_explicit(&logger.sinkDropped, 1, memory_order_relaxed);
+        return;
+    }
+
+    SinkLine *s = &logger.sinkLines[head & (logger.size - 1)];
+    s->level = (unsigned char)level;
+    snprintf(s->line, sizeof(s->line), "%s", line);
+    atomic_store_explicit(&logger.sinkHead, head + 1, memory_order_release);
+}
+
+static void write_line(logLevel_t level, uint64_t time, const char *line) {
+    if (logger.sink && !logger.file) {
+        queue_sink_line(level, line);
+        return;
+    }
+
+    FILE *out = logger.file ? logger.file : stderr;
+    time_t sec = (time_t)(time / NS_PER_SEC);
+    struct tm tm;
+    char stamp[32];
+    localtime_r(&sec, &tm);
+    strftime(stamp, sizeof(stamp), "%Y-%m-%dT%H:%M:%S", &tm);
+    fprintf(out, "%s.%03u %s %s\n", stamp, (unsigned)((time % NS_PER_SEC) / NS_PER_MS),
+            levelNames[level], line);
+}
+
+static AggEntry *find_agg(const LogRecord *rec) {
+    size_t idx = (((uintptr_t)rec->msg >> 3) ^ rec->sub) % AGG_SLOTS;
+
+    for (size_t n = 0; n < AGG_SLOTS; n++, idx = (idx + 1) % AGG_SLOTS) {
+        AggEntry *e = &logger.agg[idx];
+        if (!e->msg) {
+            e->msg = rec->msg;
+            e->sub = rec->sub;
+            return e;
+        }
+        if (e->msg == rec->msg && e->sub == rec->sub)
+            return e;
+    }
+
+    return NULL; // Table full, write without aggregation
+}
+
+static void flush_agg(AggEntry *e, uint64_t now) {
+    if (e->suppressed > 0) {
+        char suffix[64];
+        char line[LINE_LEN];
+        LogRecord rec = {.msg = e->msg, .sub = e->sub, .detail = ""};
+
+        snprintf(suffix, sizeof(suffix), " (%u suppressed in last %us)", e->suppressed,
+                 (unsigned)(logger.window / NS_PER_SEC));
+        format_line(&rec, suffix, line, sizeof(line));
+        write_line((logLevel_t)e->level, realtime_ns(), line);
+    }
+
+    e->windowStart = now;
+    e->written = 0;
+    e->suppressed = 0;
+}
+
+static void process_record(const LogRecord *rec, uint64_t now) {
+    AggEntry *e = find_agg(rec);
+
+    if (e) {
+        if (now - e->windowStart >= logger.window)
+            flush_agg(e, now);
+
+        // Keep the most severe level seen in the window for the summary line
+        if (e->written == 0 && e->suppressed == 0)
+            e->level = rec->level;
+        else if (rec->level > e->level)
+            e->level = rec->level;
+
+        if (e->written >= logger.burst) {
+            e->suppressed++;
+            return;
+        }
+        e->written++;
+    }
+
+    char line[LINE_LEN];
+    format_line(rec, "", line, sizeof(line));
+    write_line((logLevel_t)rec->level, rec->time, line);
+}
+
+static bool dequeue(LogRecord *rec) {
+    LogSlot *slot = &logger.slots[logger.dequeuePos & (logger.size - 1)];
+    size_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+
+    if (seq != logger.dequeuePos + 1)
+        return false;
+
+    *rec = slot->rec;
+    atomic_store_explicit(&slot->seq, logger.dequeuePos + logger.size, memory_order_release);
+    logger.dequeuePos++;
+    return true;
+}
+
+static void drain(void) {
+    LogRecord rec;
+    uint64_t now = now_ns();
+
+    while (dequeue(&rec))
+        process_record(&rec, now);
+
+    for (int i = 0; i < AGG_SLOTS; i++) {
+        AggEntry *e = &logger.agg[i];
+        if (e->msg && e->suppressed > 0 && now - e->windowStart >= logger.window)
+            flush_agg(e, now);
+    }
+
+    uint64_t dropped = atomic_exchange_explicit(&logger.dropped, 0, memory_order_relaxed);
+    if (dropped > 0) {
+        char line[LINE_LEN];
+        snprintf(line, sizeof(line),
+                 "[WEATHER_COLLECTOR] [log] %" PRIu64 " records dropped, log ring full",
+                 dropped);
+        write_line(LOG_LVL_WARNING, realtime_ns(), line);
+    }
+
+    if (logger.file)
+        fflush(logger.file);
+}
+
+static void *logger_thread(void *arg) {
+    (void)arg;
+
+    struct timespec poll = {0, POLL_MS * NS_PER_MS};
+
+    while (!atomic_load_explicit(&logger.shutdown, memory_order_acquire)) {
+        drain();
+        nanosleep(&poll, NULL);
+    }
+
+    // Final pass, including the pending suppression summaries
+    drain();
+    uint64_t now = now_ns();
+    for (int i = 0; i < AGG_SLOTS; i++) {
+        if (logger.agg[i].msg)
+            flush_agg(&logger.agg[i], now);
+    }
+    if (logger.file)
+        fflush(logger.file);
+
+    return NULL;
+}
+
+bool init_logger(struct mosquitto_opt *options, int optionsCount, logSink_t sink) {
+    int ringSize = 0;
+    int window = 0;
+    int burst = -1;
+    const char *file = NULL;
+    unsigned char level = LOG_LVL_INFO;
+
+    for (int i = 0; i < optionsCount; i++) {
+        if (strcmp(options[i].key, "log_level") == 0) {
+            if (!parse_level(options[i].value, &level)) {
+                fprintf(stderr, "[WEATHER_COLLECTOR] Invalid log_level: %s\n",
+                        options[i].value);
+                return false;
+            }
+        }
+        else if (strcmp(options[i].key, "log_buffer") == 0)
+            ringSize = atoi(options[i].value);
+        else if (strcmp(options[i].key, "log_window") == 0)
+            window = atoi(options[i].value);
+        else if (strcmp(options[i].key, "log_burst") == 0)
+            burst = atoi(options[i].value);
+        else if (strcmp(options[i].key, "log_file") == 0)
+            file = options[i].value;
+    }
+
+    for (int s = 0; s < LOG_SUB_COUNT; s++)
+        logLevels[s] = level;
+
+    // Per subsystem overrides, e.g. log_level_acl warning
+    for (int i = 0; i < optionsCount; i++) {
+        if (strncmp(options[i].key, "log_level_", 10) != 0)
+            continue;
+
+        int s = 0;
+        while (s < LOG_SUB_COUNT && strcmp(options[i].key + 10, subNames[s]) != 0)
+            s++;
+
+        if (s == LOG_SUB_COUNT || !parse_level(options[i].value, &logLevels[s])) {
+            fprintf(stderr, "[WEATHER_COLLECTOR] Invalid %s: %s\n", options[i].key,
+                    options[i].value);
+            return false;
+        }
+    }
+
+    if (ringSize <= 0)
+        ringSize = DEFAULT_RING_SIZE;
+    if (window <= 0)
+        window = DEFAULT_WINDOW_SEC;
+    if (burst < 0)
+        burst = DEFAULT_BURST;
+
+    logger.size = 1;
+    while (logger.size < (size_t)ringSize)
+        logger.size <<= 1;
+
+    logger.slots = malloc(sizeof(LogSlot) * logger.size);
+    logger.sinkLines = file || !sink ? NULL : malloc(sizeof(SinkLine) * logger.size);
+    if (!logger.slots || (!file && sink && !logger.sinkLines)) {
+        perror("malloc");
+        free(logger.slots);
+        free(logger.sinkLines);
+        logger.slots = NULL;
+        logger.sinkLines = NULL;
+        return false;
+    }
+    for (size_t i = 0; i < logger.size; i++)
+        atomic_init(&logger.slots[i].seq, i);
+
+    if (file) {
+        logger.file = fopen(file, "a");
+        if (!logger.file) {
+            fprintf(stderr, "[WEATHER_COLLECTOR] Can't open log_file %s\n", file);
+            free(logger.slots);
+            logger.slots = NULL;
+            return false;
+        }
+    }
+
+    logger.sink = sink;
+    logger.window = (uint64_t)window * NS_PER_SEC;
+    logger.burst = (unsigned)burst;
+    logger.dequeuePos = 0;
+    memset(logger.agg, 0, sizeof(logger.agg));
+    atomic_store(&logger.enqueuePos, 0);
+    atomic_store(&logger.dropped, 0);
+    atomic_store(&logger.sinkHead, 0);
+    atomic_store(&logger.sinkTail, 0);
+    atomic_store(&logger.sinkDropped, 0);
+    atomic_store(&logger.shutdown, false);
+
+    if (pthread_create(&logger.thread, NULL, logger_thread, NULL) != 0) {
+        if (logger.file)
+            fclose(logger.file);
+        logger.file = NULL;
+        free(logger.slots);
+        free(logger.sinkLines);
+        logger.slots = NULL;
+        logger.sinkLines = NULL;
+        return false;
+    }
+
+    atomic_store_explicit(&logger.running, true, memory_order_release);
+    return true;
+}
+
+void free_logger(void) {
+    if (!atomic_exchange(&logger.running, false))
+        return;
+
+    atomic_store_explicit(&logger.shutdown, true, memory_order_release);
+    pthread_join(logger.thread, NULL);
+
+    // The logger thread is gone, hand the last lines to the sink from here
+    log_flush();
+
+    if (logger.file)
+        fclose(logger.file);
+    logger.file = NULL;
+    free(logger.slots);
+    free(logger.sinkLines);
+    logger.slots = NULL;
+    logger.sinkLines = NULL;
+}
+
+void log_flush(void) {
+    if (!logger.sinkLines)
+        return;
+
+    size_t tail = atomic_load_explicit(&logger.sinkTail, memory_order_relaxed);
+    size_t head = atomic_load_explicit(&logger.sinkHead, memory_order_acquire);
+
+    for (; tail != head; tail++) {
+        SinkLine *s = &logger.sinkLines[tail & (logger.size - 1)];
+        logger.sink((logLevel_t)s->level, s->line);
+    }
+    atomic_store_explicit(&logger.sinkTail, tail, memory_order_release);
+
+    uint64_t dropped = atomic_exchange_explicit(&logger.sinkDropped, 0, memory_order_relaxed);
+    if (dropped > 0) {
+        char line[LINE_LEN];
+        snprintf(line, sizeof(line),
+                 "[WEATHER_COLLECTOR] [log] %" PRIu64 " lines dropped, sink backlog full", dropped);
+        logger.sink(LOG_LVL_WARNING, line);
+    }
+}
+
+void log_enqueue(logSubsystem_t sub, logLevel_t level, const char *msg, const char *detail) {
+    if (!atomic_load_explicit(&logger.running, memory_order_acquire)) {
+        LogRecord rec = {.msg = msg, .sub = sub, .detail = ""};
+        char line[LINE_LEN];
+        if (detail)
+            snprintf(rec.detail, sizeof(rec.detail), "%s", detail);
+        format_line(&rec, "", line, sizeof(line));
+        fprintf(stderr, "%s\n", line);
+        return;
+    }
+
+    size_t pos = atomic_load_explicit(&logger.enqueuePos, memory_order_relaxed);
+    LogSlot *slot;
+
+    for (;;) {
+        slot = &logger.slots[pos & (logger.size - 1)];
+        size_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&logger.enqueuePos, &pos, pos + 1,
+                                                      memory_order_relaxed,
+                                                      memory_order_relaxed))
+                break;
+        }
+        else if (diff < 0) {
+            atomic_fetch_add_explicit(&logger.dropped, 1, memory_order_relaxed);
+            return;
+        }
+        else {
+            pos = atomic_load_explicit(&logger.enqueuePos, memory_order_relaxed);
+        }
+    }
+
+    slot->rec.time = realtime_ns();
+    slot->rec.msg = msg;
+    slot->rec.level = (unsigned char)level;
+    slot->rec.sub = (unsigned char)sub;
+    if (detail) {
+        size_t len = strnlen(detail, DETAIL_LEN - 1);
+        memcpy(slot->rec.detail, detail, len);
+        slot->rec.detail[len] = '\0';
+    }
+    else {
+        slot->rec.detail[0] = '\0';
+    }
+
+    atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);
+}
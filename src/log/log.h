@@ -0,0 +1,52 @@
+#ifndef LOG_H
+#define LOG_H
+
+#include <stdbool.h>
+
+struct mosquitto_opt;
+
+typedef enum {
+    LOG_LVL_DEBUG = 0,
+    LOG_LVL_INFO,
+    LOG_LVL_NOTICE,
+    LOG_LVL_WARNING,
+    LOG_LVL_ERR,
+    LOG_LVL_NONE // Only used as a threshold, disables a subsystem
+} logLevel_t;
+
+typedef enum {
+    LOG_SUB_AUTH = 0,
+    LOG_SUB_ACL,
+    LOG_SUB_INGEST,
+    LOG_SUB_DB,
+    LOG_SUB_RATELIMIT,
+    LOG_SUB_TRACE,
+    LOG_SUB_COUNT
+} logSubsystem_t;
+
+// Receives formatted lines from log_flush, NULL writes to stderr. Ignored when log_file is set
+typedef void (*logSink_t)(logLevel_t level, const char *line);
+
+// Minimum level per subsystem, checked inline so filtered records cost one load
+extern unsigned char logLevels[LOG_SUB_COUNT];
+
+bool init_logger(struct mosquitto_opt *options, int optionsCount, logSink_t sink);
+
+// Drains the pending records before stopping the logger thread
+void free_logger(void);
+
+// Passes the lines formatted by the logger thread to the sink, called periodically from the
+// thread the sink belongs to
+void log_flush(void);
+
+// msg must be a string literal, it is the key used to aggregate repeated records. detail is
+// copied (truncated) and may be NULL. Without a running logger the line is written synchronously.
+void log_enqueue(logSubsystem_t sub, logLevel_t level, const char *msg, const char *detail);
+
+static inline void log_event(logSubsystem_t sub, logLevel_t level, const char *msg,
+                             const char *detail) {
+    if (level >= logLevels[sub])
+        log_enqueue(sub, level, msg, detail);
+}
+
+#endif
@@ -1,9 +1,14 @@
+#define _GNU_SOURCE
+#include <errno.h>
 #include <mosquitto_plugin.h>
 #include <pthread.h>
+#include <sched.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
 #include <unistd.h>
 
 typedef struct Task {
@@ -22,20 +27,286 @@ typedef struct {
     int taskCount;
 } TaskQueue;
 
+typedef struct {
+    cpu_set_t cpus;
+    bool restrictCpus; // cpus differs from the inherited affinity
+    bool pinCores;     // One cpu per worker instead of the whole set
+    int brokerCpu;     // -1 if the broker thread is not pinned
+    int policy;
+    int priority;
+    int nice;
+    bool setNice;
+} WorkerConfig;
+
 typedef struct {
     pthread_t *threads;
     TaskQueue queue;
+    WorkerConfig config;
     int numThreads;
+    cpu_set_t brokerCpus; // Broker affinity before pinning, restored on failure
+    int ready;            // Workers done with setup_worker, under the queue mutex
+    bool setupFailed;
 } ThreadPool;
 
 // Global pool
 ThreadPool pool;
 
+// Accepts lists like "0-3,6"
+static bool parse_cpu_list(const char *str, cpu_set_t *set) {
+    CPU_ZERO(set);
+
+    while (*str) {
+        char *end;
+        long first = strtol(str, &end, 10);
+        long last = first;
+        if (end == str || first < 0)
+            return false;
+
+        if (*end == '-') {
+            str = end + 1;
+            last = strtol(str, &end, 10);
+            if (end == str || last < first)
+                return false;
+        }
+
+        if (last >= CPU_SETSIZE)
+            return false;
+        for (long cpu = first; cpu <= last; cpu++)
+            CPU_SET(cpu, set);
+
+        if (*end == ',')
+            end++;
+        else if (*end != '\0')
+            return false;
+        str = end;
+    }
+
+    return CPU_COUNT(set) > 0;
+}
+
+static void format_cpu_list(const cpu_set_t *set, char *buf, size_t len) {
+    size_t off = 0;
+    buf[0] = '\0';
+
+    for (int cpu = 0; cpu < CPU_SETSIZE && off < len; cpu++) {
+        if (!CPU_ISSET(cpu, set))
+            continue;
+
+        int last = cpu;
+        while (last + 1 < CPU_SETSIZE && CPU_ISSET(last + 1, set))
+            last++;
+
+        int n;
+        if (last == cpu)
+            n = snprintf(buf + off, len - off, "%s%d", off ? "," : "", cpu);
+        else
+            n = snprintf(buf + off, len - off, "%s%d-%d", off ? "," : "", cpu, last);
+        if (n < 0)
+            break;
+        off += (size_t)n;
+        cpu = last;
+    }
+}
+
+static bool parse_sched_policy(const char *str, int *policy) {
+    if (strcmp(str, "other") == 0)
+        *policy = SCHED_OTHER;
+    else if (strcmp(str, "batch") == 0)
+        *policy = SCHED_BATCH;
+    else if (strcmp(str, "idle") == 0)
+        *policy = SCHED_IDLE;
+    else if (strcmp(str, "fifo") == 0)
+        *policy = SCHED_FIFO;
+    else if (strcmp(str, "rr") == 0)
+        *policy = SCHED_RR;
+    else
+        return false;
+    return true;
+}
+
+static const char *sched_policy_name(int policy) {
+    switch (policy) {
+        case SCHED_BATCH:
+            return "batch";
+        case SCHED_IDLE:
+            return "idle";
+        case SCHED_FIFO:
+            return "fifo";
+        case SCHED_RR:
+            return "rr";
+        default:
+            return "other";
+    }
+}
+
+static bool parse_worker_config(struct mosquitto_opt *options, int optionsCount,
+                                WorkerConfig *cfg) {
+    const char *cpus = NULL;
+    const char *policy = NULL;
+
+    cfg->pinCores = false;
+    cfg->brokerCpu = -1;
+    cfg->policy = SCHED_OTHER;
+    cfg->priority = 0;
+    cfg->setNice = false;
+
+    for (int i = 0; i < optionsCount; i++) {
+        if (strcmp(options[i].key, "worker_cpus") == 0)
+            cpus = options[i].value;
+        else if (strcmp(options[i].key, "worker_cpu_pinning") == 0)
+            cfg->pinCores = strcmp(options[i].value, "core") == 0;
+        else if (strcmp(options[i].key, "broker_cpu") == 0)
+            cfg->brokerCpu = atoi(options[i].value);
+        else if (strcmp(options[i].key, "worker_sched_policy") == 0)
+            policy = options[i].value;
+        else if (strcmp(options[i].key, "worker_sched_priority") == 0)
+            cfg->priority = atoi(options[i].value);
+        else if (strcmp(options[i].key, "worker_nice") == 0) {
+            cfg->nice = atoi(options[i].value);
+            cfg->setNice = true;
+        }
+    }
+
+    if (cpus) {
+        if (!parse_cpu_list(cpus, &cfg->cpus)) {
+            fprintf(stderr, "[WEATHER_COLLECTOR] Invalid worker_cpus: %s\n", cpus);
+            return false;
+        }
+        cfg->restrictCpus = true;
+    }
+    else {
+        if (sched_getaffinity(0, sizeof(cpu_set_t), &cfg->cpus) != 0) {
+            perror("sched_getaffinity");
+            return false;
+        }
+        cfg->restrictCpus = false;
+    }
+
+    if (cfg->brokerCpu >= CPU_SETSIZE) {
+        fprintf(stderr, "[WEATHER_COLLECTOR] Invalid broker_cpu: %d\n", cfg->brokerCpu);
+        return false;
+    }
+
+    // Workers would otherwise inherit the broker pinning
+    if (cfg->brokerCpu >= 0) {
+        CPU_CLR(cfg->brokerCpu, &cfg->cpus);
+        cfg->restrictCpus = true;
+    }
+
+    if (CPU_COUNT(&cfg->cpus) == 0) {
+        fprintf(stderr, "[WEATHER_COLLECTOR] No cpus left for the workers\n");
+        return false;
+    }
+
+    if (policy && !parse_sched_policy(policy, &cfg->policy)) {
+        fprintf(stderr, "[WEATHER_COLLECTOR] Invalid worker_sched_policy: %s\n", policy);
+        return false;
+    }
+
+    // Only the realtime policies take a static priority
+    if (cfg->policy != SCHED_FIFO && cfg->policy != SCHED_RR)
+        cfg->priority = 0;
+    else if (cfg->priority < sched_get_priority_min(cfg->policy) ||
+             cfg->priority > sched_get_priority_max(cfg->policy)) {
+        fprintf(stderr, "[WEATHER_COLLECTOR] Invalid worker_sched_priority: %d\n",
+                cfg->priority);
+        return false;
+    }
+
+    return true;
+}
+
+// Applies the settings that can only be changed from the worker itself
+static bool setup_worker(const WorkerConfig *cfg) {
+    if (cfg->setNice) {
+        // Linux applies PRIO_PROCESS to a single thread when given its tid
+        if (setpriority(PRIO_PROCESS, (id_t)syscall(SYS_gettid), cfg->nice) != 0) {
+            fprintf(stderr, "[WEATHER_COLLECTOR] Worker nice error: %s\n", strerror(errno));
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static bool apply_worker_attrs(pthread_t thread, int index, const WorkerConfig *cfg) {
+    int err;
+
+    if (cfg->restrictCpus || cfg->pinCores) {
+        cpu_set_t set = cfg->cpus;
+
+        if (cfg->pinCores) {
+            // Round robin over the allowed cpus
+            int nth = index % CPU_COUNT(&cfg->cpus);
+            CPU_ZERO(&set);
+            for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+                if (CPU_ISSET(cpu, &cfg->cpus) && nth-- == 0) {
+                    CPU_SET(cpu, &set);
+                    break;
+                }
+            }
+        }
+
+        err = pthread_setaffinity_np(thread, sizeof(cpu_set_t), &set);
+        if (err != 0) {
+            fprintf(stderr, "[WEATHER_COLLECTOR] Worker affinity error: %s\n", strerror(err));
+            return false;
+        }
+    }
+
+    if (cfg->policy != SCHED_OTHER) {
+        struct sched_param param = {.sched_priority = cfg->priority};
+        err = pthread_setschedparam(thread, cfg->policy, &param);
+        if (err != 0) {
+            fprintf(stderr, "[WEATHER_COLLECTOR] Worker scheduling error: %s\n", strerror(err));
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static void restore_broker_affinity(void) {
+    if (pool.config.brokerCpu >= 0)
+        pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &pool.brokerCpus);
+}
+
+// Undoes a partial init_thread_pool, started is the number of workers already running
+static void abort_thread_pool(int started) {
+    TaskQueue *q = &pool.queue;
+
+    pthread_mutex_lock(&q->mutex);
+    q->shutdown = 1;
+    pthread_cond_broadcast(&q->cond);
+    pthread_mutex_unlock(&q->mutex);
+
+    for (int i = 0; i < started; i++) {
+        pthread_join(pool.threads[i], NULL);
+    }
+
+    free(pool.threads);
+    pool.threads = NULL;
+    pool.numThreads = 0;
+    pthread_mutex_destroy(&q->mutex);
+    pthread_cond_destroy(&q->cond);
+    pthread_cond_destroy(&q->done);
+    restore_broker_affinity();
+}
+
 void *worker(void *arg) {
     (void)arg;
 
     TaskQueue *q = &pool.queue;
 
+    // Report back so init_thread_pool only returns once every setting is really applied
+    bool ok = setup_worker(&pool.config);
+    pthread_mutex_lock(&q->mutex);
+    pool.ready++;
+    if (!ok)
+        pool.setupFailed = true;
+    pthread_cond_broadcast(&q->done);
+    pthread_mutex_unlock(&q->mutex);
+
     while (1) {
         pthread_mutex_lock(&q->mutex);
         while (q->front == NULL && !q->shutdown) {
@@ -79,29 +350,67 @@ bool init_thread_pool(struct mosquitto_opt *options, int optionsCount) {
             numThreads = 1;
     }
 
+    if (!parse_worker_config(options, optionsCount, &pool.config))
+        return false;
+
+    // Called from the broker thread, keep it on its own cpu
+    if (pool.config.brokerCpu >= 0) {
+        cpu_set_t brokerSet;
+        CPU_ZERO(&brokerSet);
+        CPU_SET(pool.config.brokerCpu, &brokerSet);
+        int err = pthread_getaffinity_np(pthread_self(), sizeof(cpu_set_t), &pool.brokerCpus);
+        if (err == 0)
+            err = pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &brokerSet);
+        if (err != 0) {
+            fprintf(stderr, "[WEATHER_COLLECTOR] Broker affinity error: %s\n", strerror(err));
+            return false;
+        }
+    }
+
     pool.numThreads = numThreads;
     pool.threads = malloc(sizeof(pthread_t) * numThreads);
-    if (!pool.threads)
+    if (!pool.threads) {
+        restore_broker_affinity();
         return false;
+    }
 
     TaskQueue *q = &pool.queue;
     q->front = q->rear = NULL;
     q->shutdown = 0;
     q->taskCount = 0;
+    pool.ready = 0;
+    pool.setupFailed = false;
 
-    if (pthread_mutex_init(&q->mutex, NULL) != 0)
-        return false;
-    if (pthread_cond_init(&q->cond, NULL) != 0)
-        return false;
-    if (pthread_cond_init(&q->done, NULL) != 0)
+    if (pthread_mutex_init(&q->mutex, NULL) != 0 || pthread_cond_init(&q->cond, NULL) != 0 ||
+        pthread_cond_init(&q->done, NULL) != 0) {
+        free(pool.threads);
+        pool.threads = NULL;
+        restore_broker_affinity();
         return false;
+    }
 
     for (int i = 0; i < pool.numThreads; i++) {
         if (pthread_create(&pool.threads[i], NULL, worker, NULL) != 0) {
+            abort_thread_pool(i);
+            return false;
+        }
+        if (!apply_worker_attrs(pool.threads[i], i, &pool.config)) {
+            abort_thread_pool(i + 1);
             return false;
         }
     }
 
+    pthread_mutex_lock(&q->mutex);
+    while (pool.ready < pool.numThreads)
+        pthread_cond_wait(&q->done, &q->mutex);
+    bool failed = pool.setupFailed;
+    pthread_mutex_unlock(&q->mutex);
+
+    if (failed) {
+        abort_thread_pool(pool.numThreads);
+        return false;
+    }
+
     return true;
 }
 
@@ -156,3 +465,24 @@ bool add_task(void (*function)(void *), void *arg) {
 
     return true;
 }
+
+void thread_pool_topology(char *buf, size_t len) {
+    const WorkerConfig *cfg = &pool.config;
+    char cpus[256];
+    char broker[16];
+    char nice[16];
+
+    format_cpu_list(&cfg->cpus, cpus, sizeof(cpus));
+    if (cfg->brokerCpu >= 0)
+        snprintf(broker, sizeof(broker), "%d", cfg->brokerCpu);
+    else
+        snprintf(broker, sizeof(broker), "unpinned");
+    if (cfg->setNice)
+        snprintf(nice, sizeof(nice), "%d", cfg->nice);
+    else
+        snprintf(nice, sizeof(nice), "inherited");
+
+    snprintf(buf, len, "workers=%d cpus=%s pinning=%s broker_cpu=%s sched=%s:%d nice=%s",
+             pool.numThreads, cpus, cfg->pinCores ? "core" : "set", broker,
+             sched_policy_name(cfg->policy), cfg->priority, nice);
+}
@@ -2,6 +2,7 @@
 #define POOL_H
 
 #include <stdbool.h>
+#include <stddef.h>
 
 bool init_thread_pool(struct mosquitto_opt *options, int optionsCount);
 
@@ -9,4 +10,8 @@ void free_thread_pool(void);
 
 bool add_task(void (*function)(void *), void *arg);
 
+// Describes the cpu set and scheduling applied to the workers, every setting was confirmed by
+// init_thread_pool before it returned
+void thread_pool_topology(char *buf, size_t len);
+
 #endif
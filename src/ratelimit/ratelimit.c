@@ -0,0 +1,316 @@
+#include <mosquitto_plugin.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../log/log.h"
+#include "../types.h"
+#include "ratelimit.h"
+
+#define DEFAULT_MAX_STATIONS 1024
+#define DEFAULT_BURST 5
+#define EXPIRE_INTERVAL_NS NS_PER_SEC
+#define DEFAULT_REFRESH_SEC 300
+
+typedef enum {
+    SLOT_EMPTY = 0,
+    SLOT_CLAIMED,
+    SLOT_READY
+} slotState_t;
+
+// Token bucket implemented as GCRA: a single theoretical arrival time per station that is advanced
+// with a CAS, so checks never block the broker thread
+typedef struct {
+    _Atomic int state;
+    char uuid[UUID_LEN];
+    _Atomic uint64_t interval;  // ns per token, 0 means unlimited
+    _Atomic uint64_t tolerance; // interval * (burst - 1)
+    _Atomic uint64_t tat;       // theoretical arrival time in ns
+    _Atomic bool throttled;
+    _Atomic uint32_t overrideGen; // Refresh that set the station limit, 0 if it uses the default
+} Bucket;
+
+typedef struct {
+    Bucket *buckets;
+    size_t size; // Power of two
+    uint64_t defaultInterval;
+    int defaultBurst;
+    _Atomic uint64_t throttledStations;
+    _Atomic uint64_t droppedMessages;
+    _Atomic bool fullWarned;
+    _Atomic uint64_t lastExpire;
+    bool overrides; // Per station limits are read from stations.rate_limits
+    uint64_t refreshInterval;
+    _Atomic uint64_t lastRefresh;
+    uint32_t overrideGen; // Only touched by the refresh, which never runs concurrently
+} RateLimiter;
+
+// Global limiter
+RateLimiter limiter;
+
+static uint64_t rate_to_interval(double rate) {
+    if (rate <= 0)
+        return 0;
+
+    uint64_t interval = (uint64_t)((double)NS_PER_SEC / rate);
+    return interval > 0 ? interval : 1;
+}
+
+static uint32_t hash_uuid(const char *uuid) {
+    // FNV-1a
+    uint32_t hash = 2166136261u;
+    for (int i = 0; i < UUID_LEN; i++) {
+        hash ^= (unsigned char)uuid[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static void clear_throttled(Bucket *b) {
+    if (atomic_load_explicit(&b->throttled, memory_order_relaxed) &&
+        atomic_exchange_explicit(&b->throttled, false, memory_order_relaxed))
+        atomic_fetch_sub_explicit(&limiter.throttledStations, 1, memory_order_relaxed);
+}
+
+static Bucket *find_bucket(const char *uuid, bool create) {
+    size_t mask = limiter.size - 1;
+    size_t idx = hash_uuid(uuid) & mask;
+
+    for (size_t n = 0; n < limiter.size; n++, idx = (idx + 1) & mask) {
+        Bucket *b = &limiter.buckets[idx];
+        int state = atomic_load_explicit(&b->state, memory_order_acquire);
+
+        if (state == SLOT_EMPTY) {
+            if (!create)
+                return NULL;
+
+            if (atomic_compare_exchange_strong_explicit(&b->state, &state, SLOT_CLAIMED,
+                                                        memory_order_acq_rel,
+                                                        memory_order_acquire)) {
+                memcpy(b->uuid, uuid, UUID_LEN);
+                atomic_store_explicit(&b->interval, limiter.defaultInterval,
+                                      memory_order_relaxed);
+                atomic_store_explicit(&b->tolerance,
+                                      limiter.defaultInterval * (limiter.defaultBurst - 1),
+                                      memory_order_relaxed);
+                atomic_store_explicit(&b->tat, 0, memory_order_relaxed);
+                atomic_store_explicit(&b->throttled, false, memory_order_relaxed);
+                atomic_store_explicit(&b->overrideGen, 0, memory_order_relaxed);
+                atomic_store_explicit(&b->state, SLOT_READY, memory_order_release);
+                return b;
+            }
+        }
+
+        // Another thread is writing the key, it is only a few stores away from ready
+        while (state == SLOT_CLAIMED)
+            state = atomic_load_explicit(&b->state, memory_order_acquire);
+
+        if (memcmp(b->uuid, uuid, UUID_LEN) == 0)
+            return b;
+    }
+
+    return NULL; // Table full
+}
+
+bool init_rate_limiter(struct mosquitto_opt *options, int optionsCount) {
+    double rate = 0;
+    int burst = 0;
+    int maxStations = 0;
+    int refresh = 0;
+    bool overrides = false;
+
+    for (int i = 0; i < optionsCount; i++) {
+        if (strcmp(options[i].key, "rate_limit") == 0)
+            rate = atof(options[i].value);
+        else if (strcmp(options[i].key, "rate_burst") == 0)
+            burst = atoi(options[i].value);
+        else if (strcmp(options[i].key, "rate_limit_stations") == 0)
+            maxStations = atoi(options[i].value);
+        else if (strcmp(options[i].key, "rate_limit_overrides") == 0)
+            overrides = strcmp(options[i].value, "true") == 0;
+        else if (strcmp(options[i].key, "rate_limit_refresh") == 0)
+            refresh = atoi(options[i].value);
+    }
+
+    if (burst <= 0)
+        burst = DEFAULT_BURST;
+    if (maxStations <= 0)
+        maxStations = DEFAULT_MAX_STATIONS;
+    if (refresh <= 0)
+        refresh = DEFAULT_REFRESH_SEC;
+
+    // Keep the load factor under 0.5 and the size a power of two for masking
+    size_t size = 1;
+    while (size < (size_t)maxStations * 2)
+        size <<= 1;
+
+    limiter.buckets = calloc(size, sizeof(Bucket));
+    if (!limiter.buckets) {
+        perror("calloc");
+        return false;
+    }
+
+    limiter.size = size;
+    limiter.defaultInterval = rate_to_interval(rate);
+    limiter.defaultBurst = burst;
+    atomic_init(&limiter.throttledStations, 0);
+    atomic_init(&limiter.droppedMessages, 0);
+    atomic_init(&limiter.fullWarned, false);
+    atomic_init(&limiter.lastExpire, 0);
+    limiter.overrides = overrides;
+    limiter.refreshInterval = (uint64_t)refresh * NS_PER_SEC;
+    atomic_init(&limiter.lastRefresh, now_ns()); // init_rate_limiter is followed by a load
+    limiter.overrideGen = 0;
+
+    return true;
+}
+
+void free_rate_limiter(void) {
+    free(limiter.buckets);
+    limiter.buckets = NULL;
+    limiter.size = 0;
+}
+
+bool rate_limit_set_station(const char *stationUUID, double rate, int burst) {
+    if (!limiter.buckets || !stationUUID || strnlen(stationUUID, UUID_LEN) < UUID_LEN)
+        return false;
+
+    Bucket *b = find_bucket(stationUUID, true);
+    if (!b)
+        return false;
+
+    if (burst <= 0)
+        burst = limiter.defaultBurst;
+
+    uint64_t interval = rate_to_interval(rate);
+    atomic_store_explicit(&b->interval, interval, memory_order_relaxed);
+    atomic_store_explicit(&b->tolerance, interval * (burst - 1), memory_order_relaxed);
+    atomic_store_explicit(&b->overrideGen, limiter.overrideGen, memory_order_relaxed);
+
+    return true;
+}
+
+bool rate_limit_overrides_enabled(void) {
+    return limiter.buckets && limiter.overrides;
+}
+
+bool rate_limit_refresh_due(void) {
+    if (!rate_limit_overrides_enabled())
+        return false;
+
+    uint64_t now = now_ns();
+    uint64_t last = atomic_load_explicit(&limiter.lastRefresh, memory_order_relaxed);
+
+    // Claimed even if the refresh fails, so an unreachable database is retried once per interval
+    return now - last >= limiter.refreshInterval &&
+           atomic_compare_exchange_strong_explicit(&limiter.lastRefresh, &last, now,
+                                                   memory_order_relaxed, memory_order_relaxed);
+}
+
+void rate_limit_begin_overrides(void) {
+    if (++limiter.overrideGen == 0)
+        limiter.overrideGen = 1;
+}
+
+// Stations whose override was not set again since rate_limit_begin_overrides go back to the
+// default limit
+void rate_limit_end_overrides(void) {
+    uint64_t tolerance = limiter.defaultInterval * (limiter.defaultBurst - 1);
+
+    for (size_t i = 0; i < limiter.size; i++) {
+        Bucket *b = &limiter.buckets[i];
+        if (atomic_load_explicit(&b->state, memory_order_acquire) != SLOT_READY)
+            continue;
+
+        uint32_t gen = atomic_load_explicit(&b->overrideGen, memory_order_relaxed);
+        if (gen == 0 || gen == limiter.overrideGen)
+            continue;
+
+        atomic_store_explicit(&b->interval, limiter.defaultInterval, memory_order_relaxed);
+        atomic_store_explicit(&b->tolerance, tolerance, memory_order_relaxed);
+        atomic_store_explicit(&b->overrideGen, 0, memory_order_relaxed);
+    }
+}
+
+rateResult_t rate_limit_check(const char *stationUUID) {
+    if (!limiter.buckets || strnlen(stationUUID, UUID_LEN) < UUID_LEN)
+        return RATE_OK;
+
+    // Only allocate a slot when there is a global limit to enforce
+    Bucket *b = find_bucket(stationUUID, limiter.defaultInterval != 0);
+    if (!b) {
+        if (limiter.defaultInterval != 0 &&
+            !atomic_exchange_explicit(&limiter.fullWarned, true, memory_order_relaxed))
+            log_event(LOG_SUB_RATELIMIT, LOG_LVL_WARNING,
+                      "Rate limiter table full, increase rate_limit_stations", NULL);
+        return RATE_OK;
+    }
+
+    uint64_t interval = atomic_load_explicit(&b->interval, memory_order_relaxed);
+    if (interval == 0) {
+        clear_throttled(b);
+        return RATE_OK;
+    }
+
+    uint64_t tolerance = atomic_load_explicit(&b->tolerance, memory_order_relaxed);
+    uint64_t now = now_ns();
+    uint64_t tat = atomic_load_explicit(&b->tat, memory_order_relaxed);
+    uint64_t newTat;
+
+    do {
+        uint64_t base = tat > now ? tat : now;
+        if (base - now > tolerance) {
+            atomic_fetch_add_explicit(&limiter.droppedMessages, 1, memory_order_relaxed);
+            if (atomic_exchange_explicit(&b->throttled, true, memory_order_relaxed))
+                return RATE_THROTTLED;
+
+            atomic_fetch_add_explicit(&limiter.throttledStations, 1, memory_order_relaxed);
+            return RATE_THROTTLE_START;
+        }
+        newTat = base + interval;
+    } while (!atomic_compare_exchange_weak_explicit(&b->tat, &tat, newTat, memory_order_relaxed,
+                                                    memory_order_relaxed));
+
+    clear_throttled(b);
+
+    return RATE_OK;
+}
+
+// A station stays flagged until its next accepted message, so one that went quiet while throttled
+// is expired here once its bucket would accept again. Scans the whole table, so it runs at most
+// once per EXPIRE_INTERVAL_NS from the tick callback instead of on the throttle path
+void rate_limit_expire(void) {
+    if (!limiter.buckets)
+        return;
+
+    uint64_t now = now_ns();
+    uint64_t last = atomic_load_explicit(&limiter.lastExpire, memory_order_relaxed);
+    if (now - last < EXPIRE_INTERVAL_NS ||
+        !atomic_compare_exchange_strong_explicit(&limiter.lastExpire, &last, now,
+                                                 memory_order_relaxed, memory_order_relaxed))
+        return;
+
+    for (size_t i = 0; i < limiter.size; i++) {
+        Bucket *b = &limiter.buckets[i];
+        if (atomic_load_explicit(&b->state, memory_order_acquire) != SLOT_READY ||
+            !atomic_load_explicit(&b->throttled, memory_order_relaxed))
+            continue;
+
+        uint64_t tat = atomic_load_explicit(&b->tat, memory_order_relaxed);
+        uint64_t tolerance = atomic_load_explicit(&b->tolerance, memory_order_relaxed);
+        if (tat <= now + tolerance)
+            clear_throttled(b);
+    }
+}
+
+uint64_t rate_limit_throttled_stations(void) {
+    return atomic_load_explicit(&limiter.throttledStations, memory_order_relaxed);
+}
+
+uint64_t rate_limit_dropped_messages(void) {
+    return atomic_load_explicit(&limiter.droppedMessages, memory_order_relaxed);
+}
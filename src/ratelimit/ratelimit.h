@@ -0,0 +1,42 @@
+#ifndef RATELIMIT_H
+#define RATELIMIT_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+struct mosquitto_opt;
+
+typedef enum {
+    RATE_OK = 0,
+    RATE_THROTTLED,      // Over the limit, station already throttled
+    RATE_THROTTLE_START  // Over the limit, first rejection since the last accepted message
+} rateResult_t;
+
+bool init_rate_limiter(struct mosquitto_opt *options, int optionsCount);
+
+void free_rate_limiter(void);
+
+// Per station override, rate <= 0 disables the limit for that station
+bool rate_limit_set_station(const char *stationUUID, double rate, int burst);
+
+// True when rate_limit_overrides is set, otherwise stations.rate_limits is never queried
+bool rate_limit_overrides_enabled(void);
+
+// True once every rate_limit_refresh seconds, the caller then reloads the overrides on a worker
+bool rate_limit_refresh_due(void);
+
+// A reload sets every override between these two calls, stations missing from it are reset
+void rate_limit_begin_overrides(void);
+void rate_limit_end_overrides(void);
+
+rateResult_t rate_limit_check(const char *stationUUID);
+
+// Clears the flag of throttled stations that stopped publishing, rate limited internally so it
+// can be called on every tick
+void rate_limit_expire(void);
+
+uint64_t rate_limit_throttled_stations(void);
+
+uint64_t rate_limit_dropped_messages(void);
+
+#endif
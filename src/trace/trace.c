@@ -0,0 +1,278 @@
+#include <inttypes.h>
+#include <mosquitto_plugin.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../log/log.h"
+#include "../types.h"
+#include "trace.h"
+
+#define TRACE_MAX_THREADS 128
+#define DEFAULT_RING_SIZE 4096
+#define DEFAULT_TRACE_FILE "/tmp/picoWeatherCollector-trace.json"
+
+// Each slot carries a sequence number so the dumper can detect spans overwritten while copying.
+// The payload is read while the owner may be writing it, so it is made of relaxed atomics too
+typedef struct {
+    _Atomic uint64_t seq; // Write index + 1, 0 while being written
+    _Atomic uint64_t start;
+    _Atomic uint64_t end;
+    _Atomic uint32_t traceId;
+    _Atomic uint32_t stage;
+} TraceSpan;
+
+// Single producer ring, only the owning thread writes
+typedef struct {
+    TraceSpan *spans;
+    _Atomic uint64_t head;
+    long tid;
+} TraceRing;
+
+typedef struct {
+    _Atomic(TraceRing *) rings[TRACE_MAX_THREADS];
+    _Atomic int ringCount;
+    _Atomic unsigned generation; // Invalidates thread local rings after free_tracer
+    size_t ringSize;             // Power of two
+    _Atomic uint32_t messageCount;
+    _Atomic bool dumpRequested;
+    const char *file;
+    const char *controlUser;
+    int signal;
+    struct sigaction oldAction;
+} Tracer;
+
+static const char *stageNames[TRACE_STAGE_COUNT] = {"broker", "queue", "decode", "get_conn",
+                                                    "postgres"};
+
+unsigned traceSampleRate;
+
+// Global tracer
+Tracer tracer;
+
+static _Thread_local TraceRing *threadRing;
+static _Thread_local unsigned threadGeneration;
+
+static void trace_signal_handler(int sig) {
+    (void)sig;
+    atomic_store_explicit(&tracer.dumpRequested, true, memory_order_relaxed);
+}
+
+bool init_tracer(struct mosquitto_opt *options, int optionsCount) {
+    int sample = 0;
+    int ringSize = 0;
+
+    tracer.file = DEFAULT_TRACE_FILE;
+    tracer.controlUser = NULL;
+    tracer.signal = SIGRTMIN + 1;
+
+    for (int i = 0; i < optionsCount; i++) {
+        if (strcmp(options[i].key, "trace_sample") == 0)
+            sample = atoi(options[i].value);
+        else if (strcmp(options[i].key, "trace_buffer") == 0)
+            ringSize = atoi(options[i].value);
+        else if (strcmp(options[i].key, "trace_file") == 0)
+            tracer.file = options[i].value;
+        else if (strcmp(options[i].key, "trace_control_user") == 0)
+            tracer.controlUser = options[i].value;
+        else if (strcmp(options[i].key, "trace_signal") == 0)
+            tracer.signal = atoi(options[i].value);
+    }
+
+    if (sample <= 0)
+        return true; // Tracing disabled
+
+    if (ringSize <= 0)
+        ringSize = DEFAULT_RING_SIZE;
+
+    tracer.ringSize = 1;
+    while (tracer.ringSize < (size_t)ringSize)
+        tracer.ringSize <<= 1;
+
+    atomic_store(&tracer.ringCount, 0);
+    atomic_store(&tracer.messageCount, 0);
+    atomic_store(&tracer.dumpRequested, false);
+    atomic_fetch_add(&tracer.generation, 1);
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = trace_signal_handler;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = SA_RESTART;
+    if (sigaction(tracer.signal, &sa, &tracer.oldAction) != 0) {
+        perror("sigaction");
+        return false;
+    }
+
+    traceSampleRate = (unsigned)sample;
+    return true;
+}
+
+void free_tracer(void) {
+    if (!traceSampleRate)
+        return;
+
+    traceSampleRate = 0;
+    sigaction(tracer.signal, &tracer.oldAction, NULL);
+
+    // Called after the thread pool is stopped, nobody else is writing
+    atomic_fetch_add(&tracer.generation, 1);
+    int count = atomic_load(&tracer.ringCount);
+    for (int i = 0; i < count && i < TRACE_MAX_THREADS; i++) {
+        TraceRing *ring = atomic_exchange(&tracer.rings[i], NULL);
+        if (ring) {
+            free(ring->spans);
+            free(ring);
+        }
+    }
+    atomic_store(&tracer.ringCount, 0);
+}
+
+uint32_t trace_sample_message(void) {
+    uint32_t n = atomic_fetch_add_explicit(&tracer.messageCount, 1, memory_order_relaxed) + 1;
+    if (n % traceSampleRate != 0)
+        return 0;
+    return n ? n : 1;
+}
+
+static TraceRing *get_thread_ring(void) {
+    unsigned generation = atomic_load_explicit(&tracer.generation, memory_order_relaxed);
+    if (threadGeneration == generation)
+        return threadRing;
+
+    threadGeneration = generation;
+    threadRing = NULL;
+
+    int idx = atomic_fetch_add(&tracer.ringCount, 1);
+    if (idx >= TRACE_MAX_THREADS)
+        return NULL;
+
+    TraceRing *ring = calloc(1, sizeof(TraceRing));
+    if (ring)
+        ring->spans = calloc(tracer.ringSize, sizeof(TraceSpan));
+    if (!ring || !ring->spans) {
+        free(ring);
+        ring = NULL;
+    }
+    else {
+        ring->tid = (long)syscall(SYS_gettid);
+    }
+
+    // Published even when NULL so the dumper never waits on a slot
+    atomic_store_explicit(&tracer.rings[idx], ring, memory_order_release);
+    threadRing = ring;
+    return ring;
+}
+
+void trace_record(uint32_t traceId, traceStage_t stage, uint64_t start, uint64_t end) {
+    TraceRing *ring = get_thread_ring();
+    if (!ring)
+        return;
+
+    uint64_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    TraceSpan *span = &ring->spans[head & (tracer.ringSize - 1)];
+
+    atomic_store_explicit(&span->seq, 0, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    atomic_store_explicit(&span->start, start, memory_order_relaxed);
+    atomic_store_explicit(&span->end, end, memory_order_relaxed);
+    atomic_store_explicit(&span->traceId, traceId, memory_order_relaxed);
+    atomic_store_explicit(&span->stage, stage, memory_order_relaxed);
+    atomic_store_explicit(&span->seq, head + 1, memory_order_release);
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+bool trace_dump_pending(void) {
+    if (!atomic_load_explicit(&tracer.dumpRequested, memory_order_relaxed))
+        return false;
+    return atomic_exchange_explicit(&tracer.dumpRequested, false, memory_order_relaxed);
+}
+
+void trace_request_dump(void) {
+    atomic_store_explicit(&tracer.dumpRequested, true, memory_order_relaxed);
+}
+
+bool trace_control_allowed(const char *username) {
+    return traceSampleRate && tracer.controlUser && username &&
+           strcmp(tracer.controlUser, username) == 0;
+}
+
+static int dump_ring(FILE *f, TraceRing *ring, int pid, bool *first) {
+    uint64_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    uint64_t begin = head > tracer.ringSize ? head - tracer.ringSize : 0;
+    int written = 0;
+
+    for (uint64_t i = begin; i < head; i++) {
+        TraceSpan *slot = &ring->spans[i & (tracer.ringSize - 1)];
+
+        uint64_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        uint64_t start = atomic_load_explicit(&slot->start, memory_order_relaxed);
+        uint64_t end = atomic_load_explicit(&slot->end, memory_order_relaxed);
+        uint32_t traceId = atomic_load_explicit(&slot->traceId, memory_order_relaxed);
+        uint32_t stage = atomic_load_explicit(&slot->stage, memory_order_relaxed);
+        atomic_thread_fence(memory_order_acquire);
+
+        // Skip spans that were overwritten by the owner while copying
+        if (seq != i + 1 || atomic_load_explicit(&slot->seq, memory_order_relaxed) != seq ||
+            stage >= TRACE_STAGE_COUNT)
+            continue;
+
+        fprintf(f,
+                "%s\n{\"name\":\"%s\",\"cat\":\"ingest\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,"
+                "\"pid\":%d,\"tid\":%ld,\"args\":{\"trace\":%" PRIu32 "}}",
+                *first ? "" : ",", stageNames[stage], (double)start / 1000.0,
+                (double)(end - start) / 1000.0, pid, ring->tid, traceId);
+        *first = false;
+        written++;
+    }
+
+    return written;
+}
+
+void trace_dump_task(void *arg) {
+    (void)arg;
+
+    if (!traceSampleRate)
+        return;
+
+    char tmpPath[4096];
+    snprintf(tmpPath, sizeof(tmpPath), "%s.tmp", tracer.file);
+
+    FILE *f = fopen(tmpPath, "w");
+    if (!f) {
+        log_event(LOG_SUB_TRACE, LOG_LVL_ERR, "Can't open trace file", tmpPath);
+        return;
+    }
+
+    int pid = (int)getpid();
+    bool first = true;
+    int written = 0;
+
+    fprintf(f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+
+    int count = atomic_load(&tracer.ringCount);
+    for (int i = 0; i < count && i < TRACE_MAX_THREADS; i++) {
+        TraceRing *ring = atomic_load_explicit(&tracer.rings[i], memory_order_acquire);
+        if (ring)
+            written += dump_ring(f, ring, pid, &first);
+    }
+
+    fprintf(f, "\n]}\n");
+
+    // Rename so readers never see a partial file
+    if (fclose(f) != 0 || rename(tmpPath, tracer.file) != 0) {
+        log_event(LOG_SUB_TRACE, LOG_LVL_ERR, "Error writing trace file", tracer.file);
+        return;
+    }
+
+    char detail[256];
+    snprintf(detail, sizeof(detail), "%d spans to %s", written, tracer.file);
+    log_event(LOG_SUB_TRACE, LOG_LVL_INFO, "Trace written", detail);
+}
@@ -0,0 +1,61 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "../types.h"
+
+struct mosquitto_opt;
+
+#define TRACE_CONTROL_TOPIC "$CONTROL/picoWeatherCollector/v1"
+
+typedef enum {
+    TRACE_BROKER = 0, // message_callback, copy and enqueue
+    TRACE_QUEUE,      // Waiting in the thread pool queue
+    TRACE_DECODE,     // nanopb decode
+    TRACE_GET_CONN,   // Waiting for a db connection
+    TRACE_POSTGRES,   // Insert round trip
+    TRACE_STAGE_COUNT
+} traceStage_t;
+
+// 0 when tracing is disabled, checked inline so untraced messages cost one load
+extern unsigned traceSampleRate;
+
+bool init_tracer(struct mosquitto_opt *options, int optionsCount);
+
+void free_tracer(void);
+
+// Returns a non zero trace id for 1 in trace_sample messages
+uint32_t trace_sample_message(void);
+
+void trace_record(uint32_t traceId, traceStage_t stage, uint64_t start, uint64_t end);
+
+static inline bool trace_enabled(void) {
+    return traceSampleRate != 0;
+}
+
+static inline uint32_t trace_begin(void) {
+    return traceSampleRate ? trace_sample_message() : 0;
+}
+
+static inline uint64_t trace_clock(uint32_t traceId) {
+    return traceId ? now_ns() : 0;
+}
+
+static inline void trace_span(uint32_t traceId, traceStage_t stage, uint64_t start) {
+    if (traceId)
+        trace_record(traceId, stage, start, now_ns());
+}
+
+// Set by the trace signal or the control topic, cleared when read
+bool trace_dump_pending(void);
+
+void trace_request_dump(void);
+
+bool trace_control_allowed(const char *username);
+
+// Thread pool task writing the spans as Chrome trace JSON to trace_file
+void trace_dump_task(void *arg);
+
+#endif
@@ -1,6 +1,22 @@
 #ifndef TYPES_H
 #define TYPES_H
 
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+#define UUID_LEN 36
+
+#define NS_PER_MS 1000000ULL
+#define NS_PER_SEC 1000000000ULL
+
+// CLOCK_MONOTONIC in ns, shared by the limiter, tracer, logger and db backoff
+static inline uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * NS_PER_SEC + (uint64_t)ts.tv_nsec;
+}
+
 typedef enum {
     MSG_NULL = 0,
     MSG_DATA
@@ -12,6 +28,8 @@ struct msgTask {
     uint8_t *payload;
     size_t payloadLen;
     msgType_t msgType;
+    uint32_t traceId;    // 0 when the message is not sampled
+    uint64_t enqueuedAt; // now_ns() before add_task, only set when traced
 };
 
 #endif
@@ -3,8 +3,12 @@
 #include <sodium/utils.h>
 #include <stdbool.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
+#include "../log/log.h"
+#include "../ratelimit/ratelimit.h"
+
 #define KEY_ENTROPY 32
 #define BASE64_VARIANT sodium_base64_VARIANT_URLSAFE_NO_PADDING
 
@@ -42,7 +46,7 @@ bool validate_api_key(PGconn *conn, const char *stationUUID, const char *apiKey)
                        2, NULL, paramValues, NULL, NULL, 0);
 
     if (PQresultStatus(res) != PGRES_TUPLES_OK) {
-        fprintf(stderr, "Error executing the query: %s", PQerrorMessage(conn));
+        log_event(LOG_SUB_AUTH, LOG_LVL_ERR, "Error validating the api key", PQerrorMessage(conn));
         PQclear(res);
         return false;
     }
@@ -55,3 +59,42 @@ bool validate_api_key(PGconn *conn, const char *stationUUID, const char *apiKey)
     PQclear(res);
     return true;
 }
+
+bool load_station_rate_limits(PGconn *conn) {
+    if (!conn)
+        return false;
+
+    PGresult *res = PQexec(conn, "SELECT s.uuid, r.msg_rate, r.msg_burst "
+                                 "FROM stations.rate_limits r "
+                                 "JOIN stations.stations s ON s.station_id = r.station_id");
+
+    if (PQresultStatus(res) != PGRES_TUPLES_OK) {
+        log_event(LOG_SUB_RATELIMIT, LOG_LVL_ERR, "Error loading the station rate limits",
+                  PQerrorMessage(conn));
+        PQclear(res);
+        return false;
+    }
+
+    rate_limit_begin_overrides();
+
+    int rows = PQntuples(res);
+    for (int r = 0; r < rows; r++) {
+        if (PQgetisnull(res, r, 1))
+            continue;
+
+        double rate = atof(PQgetvalue(res, r, 1));
+        int burst = PQgetisnull(res, r, 2) ? 0 : atoi(PQgetvalue(res, r, 2));
+        if (!rate_limit_set_station(PQgetvalue(res, r, 0), rate, burst))
+            log_event(LOG_SUB_RATELIMIT, LOG_LVL_WARNING, "Can't set station rate limit",
+                      PQgetvalue(res, r, 0));
+    }
+
+    rate_limit_end_overrides();
+
+    char detail[32];
+    snprintf(detail, sizeof(detail), "%d stations", rows);
+    log_event(LOG_SUB_RATELIMIT, LOG_LVL_INFO, "Rate limit overrides loaded", detail);
+
+    PQclear(res);
+    return true;
+}
@@ -5,4 +5,7 @@
 
 bool validate_api_key(PGconn *conn, const char *stationUUID, const char *apiKey);
 
+// Loads every row of stations.rate_limits into the rate limiter in one query
+bool load_station_rate_limits(PGconn *conn);
+
 #endif
@@ -1,3 +1,4 @@
+#include <inttypes.h>
 #include <libpq-fe.h>
 #include <mosquitto.h>
 #include <mosquitto_broker.h>
@@ -10,13 +11,15 @@
 
 #include "database/database.h"
 #include "handlers/handlers.h"
+#include "log/log.h"
 #include "pool/pool.h"
+#include "ratelimit/ratelimit.h"
+#include "trace/trace.h"
 #include "types.h"
 #include "utils/utils.h"
 
 #define PLUGIN_API_VERSION 5
 
-#define UUID_LEN 36
 #define PREFIX_LEN (9 + UUID_LEN + 1) // "stations/" + uuid + '/'
 
 #define MAX_PAYLOAD 4096 // 4KB
@@ -32,13 +35,16 @@ static int auth_callback(int event, void *eventData, void *userData) {
   const char *username = auth->username;
   const char *password = auth->password;
 
-  mosquitto_log_printf(
-      MOSQ_LOG_INFO,
-      "[WEATHER_COLLECTOR] Auth callback: username=%s ", username);
+  log_event(LOG_SUB_AUTH, LOG_LVL_INFO, "Auth callback", username);
 
-  PGconn *conn = get_conn();
-  if (!conn)
+  // Runs on the broker thread, never waits for a busy pool and leaves
+  // reconnecting to a worker
+  PGconn *conn = get_conn_for_station(username, 0, false);
+  if (!conn) {
+    if (db_reconnect_wanted())
+      add_task(db_reconnect_task, NULL);
     return MOSQ_ERR_AUTH;
+  }
 
   if (!validate_api_key(conn, username, password)) {
     release_conn(conn);
@@ -62,6 +68,10 @@ static int acl_callback(int event, void *eventData, void *userData) {
   if (!username || !topic)
     return MOSQ_ERR_ACL_DENIED;
 
+  if (strcmp(topic, TRACE_CONTROL_TOPIC) == 0)
+    return trace_control_allowed(username) ? MOSQ_ERR_SUCCESS
+                                           : MOSQ_ERR_ACL_DENIED;
+
   if (strncmp(topic, "stations/", 9) != 0)
     return MOSQ_ERR_ACL_DENIED;
 
@@ -73,7 +83,27 @@ static int acl_callback(int event, void *eventData, void *userData) {
   if (topic[9 + UUID_LEN] != '/')
     return MOSQ_ERR_ACL_DENIED;
 
-  mosquitto_log_printf(MOSQ_LOG_INFO, "[WEATHER_COLLECTOR] Message allowed");
+  // Drop excess publishes before message_callback copies and enqueues them
+  if (acldata->access == MOSQ_ACL_WRITE) {
+    switch (rate_limit_check(username)) {
+    case RATE_OK:
+      break;
+    case RATE_THROTTLE_START: {
+      char detail[128];
+      snprintf(detail, sizeof(detail),
+               "%s (%" PRIu64 " stations throttled, %" PRIu64 " dropped)",
+               username, rate_limit_throttled_stations(),
+               rate_limit_dropped_messages());
+      log_event(LOG_SUB_RATELIMIT, LOG_LVL_WARNING, "Station throttled",
+                detail);
+      return MOSQ_ERR_ACL_DENIED;
+    }
+    default:
+      return MOSQ_ERR_ACL_DENIED;
+    }
+  }
+
+  log_event(LOG_SUB_ACL, LOG_LVL_INFO, "Message allowed", username);
   return MOSQ_ERR_SUCCESS;
 }
 
@@ -83,6 +113,9 @@ int message_callback(int event, void *eventData, void *userData) {
 
   struct mosquitto_evt_message *msg = eventData;
 
+  uint32_t traceId = trace_begin();
+  uint64_t traceStart = trace_clock(traceId);
+
   const char *username = mosquitto_client_username(msg->client);
   const char *topic = msg->topic;
   const char *payload = msg->payload;
@@ -125,6 +158,11 @@ int message_callback(int event, void *eventData, void *userData) {
 
   memcpy(task->payload, payload, payloadLen);
   task->payloadLen = payloadLen;
+  task->traceId = traceId;
+  task->enqueuedAt = trace_clock(traceId);
+
+  if (traceId)
+    trace_record(traceId, TRACE_BROKER, traceStart, task->enqueuedAt);
 
   bool ret;
 
@@ -147,6 +185,61 @@ int message_callback(int event, void *eventData, void *userData) {
   return MOSQ_ERR_SUCCESS;
 }
 
+static void refresh_rate_limits_task(void *arg) {
+  (void)arg;
+
+  // stations.* is replicated on every node, the first target is enough
+  PGconn *conn = get_conn_for_station(NULL, DB_CONN_TIMEOUT_DEFAULT, true);
+  if (!conn)
+    return;
+
+  load_station_rate_limits(conn);
+  release_conn(conn);
+}
+
+// Runs on the broker thread, called by log_flush from tick_callback
+static void log_sink(logLevel_t level, const char *line) {
+  static const int mosqLevels[] = {MOSQ_LOG_DEBUG, MOSQ_LOG_INFO,
+                                   MOSQ_LOG_NOTICE, MOSQ_LOG_WARNING,
+                                   MOSQ_LOG_ERR};
+
+  mosquitto_log_printf(mosqLevels[level], "%s", line);
+}
+
+// Periodic housekeeping on the broker thread: writes the queued log lines,
+// expires idle throttled stations and hands refreshes and trace dumps to the
+// thread pool so they never run here
+static int tick_callback(int event, void *eventData, void *userData) {
+  (void)event;
+  (void)eventData;
+  (void)userData;
+
+  log_flush();
+  rate_limit_expire();
+
+  if (rate_limit_refresh_due())
+    add_task(refresh_rate_limits_task, NULL);
+  if (db_shard_map_refresh_due())
+    add_task(db_shard_map_refresh_task, NULL);
+
+  if (trace_enabled() && trace_dump_pending())
+    add_task(trace_dump_task, NULL);
+
+  return MOSQ_ERR_SUCCESS;
+}
+
+static int control_callback(int event, void *eventData, void *userData) {
+  (void)event;
+  (void)userData;
+
+  struct mosquitto_evt_control *ctrl = eventData;
+
+  if (ctrl->payloadlen == 10 && memcmp(ctrl->payload, "trace_dump", 10) == 0)
+    trace_request_dump();
+
+  return MOSQ_ERR_SUCCESS;
+}
+
 int mosquitto_plugin_version(int supportedVersionCount,
                              const int *supportedVersions) {
   for (int i = 0; i < supportedVersionCount; i++) {
@@ -174,23 +267,69 @@ int mosquitto_plugin_init(mosquitto_plugin_id_t *identifier, void **userData,
     return MOSQ_ERR_UNKNOWN;
   }
 
+  if (!init_logger(options, optionsCount, log_sink)) {
+    mosquitto_log_printf(MOSQ_LOG_ERR,
+                         "[WEATHER_COLLECTOR] Error starting the logger");
+    return MOSQ_ERR_UNKNOWN;
+  }
+
+  // From here on errors are queued in the logger; free_logger() prints them
   if (!init_db_vars(options, optionsCount)) {
     mosquitto_log_printf(MOSQ_LOG_ERR, "[WEATHER_COLLECTOR] Invalid db config");
+    free_db_pool();
+    free_logger();
     return MOSQ_ERR_UNKNOWN;
   }
 
   if (!init_db_pool()) {
     mosquitto_log_printf(MOSQ_LOG_ERR,
                          "[WEATHER_COLLECTOR] Error opening db connection");
+    free_logger();
+    return MOSQ_ERR_UNKNOWN;
+  }
+
+  if (!init_rate_limiter(options, optionsCount)) {
+    mosquitto_log_printf(MOSQ_LOG_ERR,
+                         "[WEATHER_COLLECTOR] Error creating rate limiter");
+    free_db_pool();
+    free_logger();
+    return MOSQ_ERR_UNKNOWN;
+  }
+
+  // Loaded once here instead of on every CONNECT, refreshed from a worker later
+  if (rate_limit_overrides_enabled()) {
+    PGconn *conn = get_conn();
+    if (!load_station_rate_limits(conn))
+      mosquitto_log_printf(MOSQ_LOG_WARNING,
+                           "[WEATHER_COLLECTOR] Rate limit overrides not loaded, "
+                           "retrying every rate_limit_refresh seconds");
+    release_conn(conn);
+  }
+
+  if (!init_tracer(options, optionsCount)) {
+    mosquitto_log_printf(MOSQ_LOG_ERR,
+                         "[WEATHER_COLLECTOR] Error initializing tracer");
+    free_rate_limiter();
+    free_db_pool();
+    free_logger();
     return MOSQ_ERR_UNKNOWN;
   }
 
   if (!init_thread_pool(options, optionsCount)) {
     mosquitto_log_printf(MOSQ_LOG_ERR,
                          "[WEATHER_COLLECTOR] Error creating thread pool");
+    free_tracer();
+    free_rate_limiter();
+    free_db_pool();
+    free_logger();
     return MOSQ_ERR_UNKNOWN;
   }
 
+  char topology[512];
+  thread_pool_topology(topology, sizeof(topology));
+  mosquitto_log_printf(MOSQ_LOG_INFO, "[WEATHER_COLLECTOR] Thread pool: %s",
+                       topology);
+
   mosquitto_callback_register(pluginId, MOSQ_EVT_BASIC_AUTH, auth_callback,
                               NULL, NULL);
   mosquitto_callback_register(pluginId, MOSQ_EVT_ACL_CHECK, acl_callback, NULL,
@@ -198,6 +337,17 @@ int mosquitto_plugin_init(mosquitto_plugin_id_t *identifier, void **userData,
   mosquitto_callback_register(pluginId, MOSQ_EVT_MESSAGE, message_callback,
                               NULL, NULL);
 
+  mosquitto_callback_register(pluginId, MOSQ_EVT_TICK, tick_callback, NULL,
+                              NULL);
+
+  if (trace_enabled()) {
+    mosquitto_callback_register(pluginId, MOSQ_EVT_CONTROL, control_callback,
+                                TRACE_CONTROL_TOPIC, NULL);
+    mosquitto_log_printf(MOSQ_LOG_INFO,
+                         "[WEATHER_COLLECTOR] Tracing 1 in %u messages",
+                         traceSampleRate);
+  }
+
   mosquitto_log_printf(MOSQ_LOG_INFO,
                        "[WEATHER_COLLECTOR] Plugin correctly initialized");
 
@@ -217,8 +367,28 @@ int mosquitto_plugin_cleanup(void *userData, struct mosquitto_opt *options,
   mosquitto_callback_unregister(pluginId, MOSQ_EVT_MESSAGE, message_callback,
                                 NULL);
 
-  free_db_pool();
+  mosquitto_callback_unregister(pluginId, MOSQ_EVT_TICK, tick_callback, NULL);
+
+  if (trace_enabled()) {
+    mosquitto_callback_unregister(pluginId, MOSQ_EVT_CONTROL, control_callback,
+                                  TRACE_CONTROL_TOPIC);
+  }
+
+  // Workers may still hold connections, stop them first
   free_thread_pool();
+  free_db_pool();
+
+  mosquitto_log_printf(MOSQ_LOG_INFO,
+                       "[WEATHER_COLLECTOR] Rate limiter dropped %" PRIu64
+                       " messages",
+                       rate_limit_dropped_messages());
+  mosquitto_log_printf(MOSQ_LOG_INFO,
+                       "[WEATHER_COLLECTOR] Database unavailable, dropped "
+                       "%" PRIu64 " messages",
+                       handler_dropped_messages());
+  free_rate_limiter();
+  free_tracer();
+  free_logger();
 
   mosquitto_log_printf(MOSQ_LOG_INFO, "[WEATHER_COLLECTOR] Plugin cleanup");
   return MOSQ_ERR_SUCCESS;